@@ -0,0 +1,381 @@
+// ****************************************************************************
+// Simulation benchmark: sweeps star count, accuracy, thread count and solver
+// over seeded galaxies and reports per-phase frame timings as CSV or JSON.
+// ****************************************************************************
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.hpp"
+#include "kernel.hpp"
+#include "world.hpp"
+
+struct result
+{
+    int stars;
+    double accuracy;
+    int threads;
+    std::string schedule;
+    std::string solver;
+    const char* kernel;
+    const char* precision;
+    std::string tree_precision;
+    std::string galaxy;
+    double build;  // mean phase durations per frame in seconds
+    double accel;
+    double integrate;
+    double total_min;  // fastest frame
+    double imbalance;  // mean of the slowest thread's force time relative to the average thread
+    size_t tree_bytes;  // peak memory of the tree quads
+};
+
+static void usage(const char* name)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -c, --config FILE      base configuration (default constel.conf); its Restart, Snapshot\n"
+            "                         and Trajectory are ignored\n"
+            "  -n, --stars LIST       star counts (default 1000,10000,100000,1000000,10000000)\n"
+            "  -a, --accuracy LIST    accuracy values, 1/theta (default from config)\n"
+            "  -t, --threads LIST     thread counts, 0 for all cores (default 1,0)\n"
+            "  -S, --schedule LIST    force pass schedules: steal, static (default from config)\n"
+            "  -m, --solver LIST      force solvers: barnes-hut, fmm (default from config)\n"
+            "  -T, --tree LIST        tree walk precisions: double, float (default from config)\n"
+            "  -g, --galaxy LIST      starting galaxies: uniform, disk, plummer, hernquist, collision\n"
+            "                         (default from config)\n"
+            "  -f, --frames N         measured frames per run (default 10)\n"
+            "  -w, --warmup N         unmeasured frames per run (default 2)\n"
+            "  -s, --seed N           random seed (default 1)\n"
+            "  -x, --check            compare the force kernels with the reference, and the vector moment\n"
+            "                         kernels with the scalar one, instead\n"
+            "  -j, --json             JSON output instead of CSV\n"
+            "  -o, --output FILE      write results to FILE instead of stdout\n",
+            name);
+}
+
+template<typename T>
+static std::vector<T> parse_list(const char* list)
+{
+    std::vector<T> values;
+    std::string str(list);
+    size_t start = 0;
+    while (start <= str.length()) {
+        size_t end = str.find(',', start);
+        if (end == std::string::npos)
+            end = str.length();
+        if (end > start)
+            values.push_back((T)atof(str.substr(start, end - start).c_str()));
+        start = end + 1;
+    }
+    return values;
+}
+
+static std::vector<std::string> parse_names(const char* list)
+{
+    std::vector<std::string> names;
+    std::string str(list);
+    size_t start = 0;
+    while (start <= str.length()) {
+        size_t end = str.find(',', start);
+        if (end == std::string::npos)
+            end = str.length();
+        if (end > start)
+            names.push_back(str.substr(start, end - start));
+        start = end + 1;
+    }
+    return names;
+}
+
+static result run(int stars, double accuracy, int threads, const std::string& schedule, const std::string& solver,
+        const std::string& tree_precision, const std::string& galaxy, int frames, int warmup, unsigned seed)
+{
+    config.stars = stars;
+    config.accuracy = accuracy;
+    config.threads = threads;
+    config.schedule = schedule;
+    config.solver = solver;
+    config.tree_precision = tree_precision;
+    config.galaxy = galaxy;
+    config.seed = seed;
+    config.restart.clear();  // every run times a new galaxy of [stars] without file I/O
+    config.snapshot.clear();
+    config.trajectory.clear();
+    init_world();
+
+    result res = { config.stars, accuracy, threads, schedule, solver, kernel_name(), config.precision.c_str(), tree_precision,
+            galaxy, 0, 0, 0, INFINITY, 0, 0 };
+    for (int i = 0; i < warmup + frames; i++) {
+        world_frame(config.time_step);
+        if (i < warmup)
+            continue;
+        res.build += perf_build.last();
+        res.accel += perf_accel.last();
+        res.integrate += perf_integrate.last();
+        res.imbalance += perf_imbalance.last();
+        res.total_min = std::min(res.total_min, (double)perf_build.last() + perf_accel.last() + perf_integrate.last());
+    }
+    res.build /= frames;
+    res.accel /= frames;
+    res.integrate /= frames;
+    res.imbalance /= frames;
+    size_t tree_used;
+    tree_memory(&tree_used, &res.tree_bytes);
+
+    finalize_world();
+    return res;
+}
+
+// Relative acceleration error of every kernel against the reference on random interaction lists
+static int check_kernels(FILE* out, unsigned seed, bool json)
+{
+    const int targets = 256;
+    const int sources = 2000;
+    const double radius = 100;
+    srand(seed);
+    std::vector<double> x(targets), y(targets);
+    interaction_list list = { 0 };
+    for (int i = 0; i < sources; i++) {
+        double r = radius * sqrt((double)rand() / RAND_MAX);
+        double dir = 2 * M_PI * rand() / RAND_MAX;
+        double mass = 1 + 999.0 * rand() / RAND_MAX;  // stars and quads
+        push_interaction(&list, r * cos(dir), r * sin(dir), mass);
+    }
+    for (int i = 0; i < targets; i++) {
+        if (i % 8 == 0) {  // the target itself is in the list
+            x[i] = list.x[i];
+            y[i] = list.y[i];
+        } else {
+            double r = radius * sqrt((double)rand() / RAND_MAX);
+            double dir = 2 * M_PI * rand() / RAND_MAX;
+            x[i] = r * cos(dir);
+            y[i] = r * sin(dir);
+        }
+    }
+
+    std::vector<double> ref_x(targets, 0), ref_y(targets, 0);
+    find_kernel("reference", "double")(x.data(), y.data(), targets, &list, config.epsilon, ref_x.data(), ref_y.data());
+
+    if (json)
+        fputs("[\n", out);
+    else
+        fputs("kernel,precision,max_rel_error,rms_rel_error\n", out);
+    bool first = true;
+    int status = 0;
+    for (const char* name : { "scalar", "avx2", "avx512" })
+    for (const char* precision : { "double", "float" }) {
+        accel_kernel_t* kernel = find_kernel(name, precision);
+        if (!kernel)
+            continue;
+        std::vector<double> accel_x(targets, 0), accel_y(targets, 0);
+        kernel(x.data(), y.data(), targets, &list, config.epsilon, accel_x.data(), accel_y.data());
+        double max_error = 0;
+        double sum_sqr = 0;
+        for (int i = 0; i < targets; i++) {
+            double error = hypot(accel_x[i] - ref_x[i], accel_y[i] - ref_y[i]) / hypot(ref_x[i], ref_y[i]);
+            max_error = std::max(max_error, error);
+            sum_sqr += error * error;
+        }
+        double rms_error = sqrt(sum_sqr / targets);
+        if (!(max_error < (strcmp(precision, "float") ? 1e-12 : 1e-5)))
+            status = 1;
+        if (json)
+            fprintf(out, "%s  {\"kernel\": \"%s\", \"precision\": \"%s\", \"max_rel_error\": %.3e, \"rms_rel_error\": %.3e}",
+                    first ? "" : ",\n", name, precision, max_error, rms_error);
+        else
+            fprintf(out, "%s,%s,%.3e,%.3e\n", name, precision, max_error, rms_error);
+        first = false;
+    }
+
+    // Vector moment kernels against the scalar one, on nodes around the sources
+    moment_list moments = { 0 };
+    for (int i = 0; i < sources / 10; i++) {
+        double q[7];
+        for (double& value : q)
+            value = 1000.0 * rand() / RAND_MAX - 500;
+        push_moments(&moments, list.x[i], list.y[i], fabs(q[0]), q[1], fabs(q[2]), q[3], q[4], q[5], q[6]);
+    }
+    std::vector<double> moment_x(targets, 0), moment_y(targets, 0);
+    find_moment_kernel("scalar")(x.data(), y.data(), targets, &moments, 3, config.epsilon, moment_x.data(), moment_y.data());
+    for (const char* name : { "avx2", "avx512" }) {
+        moment_kernel_t* kernel = find_moment_kernel(name);
+        if (!kernel)
+            continue;
+        std::vector<double> accel_x(targets, 0), accel_y(targets, 0);
+        kernel(x.data(), y.data(), targets, &moments, 3, config.epsilon, accel_x.data(), accel_y.data());
+        double max_error = 0;
+        double sum_sqr = 0;
+        for (int i = 0; i < targets; i++) {
+            double error = hypot(accel_x[i] - moment_x[i], accel_y[i] - moment_y[i]) / hypot(moment_x[i], moment_y[i]);
+            max_error = std::max(max_error, error);
+            sum_sqr += error * error;
+        }
+        double rms_error = sqrt(sum_sqr / targets);
+        if (!(max_error < 1e-12))
+            status = 1;
+        if (json)
+            fprintf(out, ",\n  {\"kernel\": \"%s-moments\", \"precision\": \"double\", \"max_rel_error\": %.3e, \"rms_rel_error\": %.3e}",
+                    name, max_error, rms_error);
+        else
+            fprintf(out, "%s-moments,double,%.3e,%.3e\n", name, max_error, rms_error);
+    }
+
+    if (json)
+        fputs("\n]\n", out);
+    free_interaction_list(&list);
+    free_moment_list(&moments);
+    return status;
+}
+
+static void print_csv(FILE* out, const std::vector<result>& results, unsigned seed, int frames)
+{
+    fputs("stars,accuracy,threads,schedule,solver,kernel,precision,tree_precision,galaxy,seed,frames,build_ms,accel_ms,integrate_ms,total_ms,total_min_ms,imbalance,tree_mb\n", out);
+    for (const result& res : results)
+        fprintf(out, "%d,%g,%d,%s,%s,%s,%s,%s,%s,%u,%d,%.4f,%.4f,%.4f,%.4f,%.4f,%.3f,%.2f\n",
+                res.stars, res.accuracy, res.threads, res.schedule.c_str(), res.solver.c_str(), res.kernel, res.precision,
+                res.tree_precision.c_str(), res.galaxy.c_str(), seed, frames,
+                1e3 * res.build, 1e3 * res.accel, 1e3 * res.integrate,
+                1e3 * (res.build + res.accel + res.integrate), 1e3 * res.total_min, res.imbalance, res.tree_bytes / 1048576.0);
+}
+
+static void print_json(FILE* out, const std::vector<result>& results, unsigned seed, int frames)
+{
+    fputs("[\n", out);
+    for (size_t i = 0; i < results.size(); i++) {
+        const result& res = results[i];
+        fprintf(out, "  {\"stars\": %d, \"accuracy\": %g, \"threads\": %d, \"schedule\": \"%s\", \"solver\": \"%s\", \"kernel\": \"%s\", \"precision\": \"%s\", \"tree_precision\": \"%s\", \"galaxy\": \"%s\", \"seed\": %u, \"frames\": %d, "
+                "\"build_ms\": %.4f, \"accel_ms\": %.4f, \"integrate_ms\": %.4f, "
+                "\"total_ms\": %.4f, \"total_min_ms\": %.4f, \"imbalance\": %.3f, \"tree_mb\": %.2f}%s\n",
+                res.stars, res.accuracy, res.threads, res.schedule.c_str(), res.solver.c_str(), res.kernel, res.precision,
+                res.tree_precision.c_str(), res.galaxy.c_str(), seed, frames,
+                1e3 * res.build, 1e3 * res.accel, 1e3 * res.integrate,
+                1e3 * (res.build + res.accel + res.integrate), 1e3 * res.total_min, res.imbalance, res.tree_bytes / 1048576.0,
+                i + 1 < results.size() ? "," : "");
+    }
+    fputs("]\n", out);
+}
+
+int main(int argc, char **argv)
+{
+    static const option options[] = {
+            {"config",   required_argument, NULL, 'c'},
+            {"stars",    required_argument, NULL, 'n'},
+            {"accuracy", required_argument, NULL, 'a'},
+            {"threads",  required_argument, NULL, 't'},
+            {"schedule", required_argument, NULL, 'S'},
+            {"solver",   required_argument, NULL, 'm'},
+            {"tree",     required_argument, NULL, 'T'},
+            {"galaxy",   required_argument, NULL, 'g'},
+            {"frames",   required_argument, NULL, 'f'},
+            {"warmup",   required_argument, NULL, 'w'},
+            {"seed",     required_argument, NULL, 's'},
+            {"check",    no_argument,       NULL, 'x'},
+            {"json",     no_argument,       NULL, 'j'},
+            {"output",   required_argument, NULL, 'o'},
+            {"help",     no_argument,       NULL, 'h'},
+            {NULL, 0, NULL, 0},
+    };
+
+    std::string config_file;
+    const char* output = NULL;
+    std::vector<int> star_counts = { 1000, 10000, 100000, 1000000, 10000000 };
+    std::vector<double> accuracies;
+    std::vector<int> thread_counts = { 1, 0 };
+    std::vector<std::string> schedules;
+    std::vector<std::string> solvers;
+    std::vector<std::string> tree_precisions;
+    std::vector<std::string> galaxies;
+    int frames = 10;
+    int warmup = 2;
+    unsigned seed = 1;
+    bool json = false;
+    bool check = false;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "c:n:a:t:S:m:T:g:f:w:s:xjo:h", options, NULL)) != -1) {
+        switch (opt) {
+        case 'c': config_file = optarg; break;
+        case 'n': star_counts = parse_list<int>(optarg); break;
+        case 'a': accuracies = parse_list<double>(optarg); break;
+        case 't': thread_counts = parse_list<int>(optarg); break;
+        case 'S': schedules = parse_names(optarg); break;
+        case 'm': solvers = parse_names(optarg); break;
+        case 'T': tree_precisions = parse_names(optarg); break;
+        case 'g': galaxies = parse_names(optarg); break;
+        case 'f': frames = atoi(optarg); break;
+        case 'w': warmup = atoi(optarg); break;
+        case 's': seed = strtoul(optarg, NULL, 0); break;
+        case 'x': check = true; break;
+        case 'j': json = true; break;
+        case 'o': output = optarg; break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (frames < 1)
+        frames = 1;
+
+    config.load(config_file);
+    if (!config.replay.empty()) {
+        fprintf(stderr, "Replay is set in the configuration; the benchmark needs a simulated galaxy\n");
+        return 1;
+    }
+    if (accuracies.empty())
+        accuracies.push_back(config.accuracy);
+    if (schedules.empty())
+        schedules.push_back(config.schedule);
+    if (solvers.empty())
+        solvers.push_back(config.solver);
+    if (tree_precisions.empty())
+        tree_precisions.push_back(config.tree_precision);
+    if (galaxies.empty())
+        galaxies.push_back(config.galaxy);
+
+    if (check) {
+        FILE* out = output ? fopen(output, "w") : stdout;
+        if (!out) {
+            fprintf(stderr, "Cannot open '%s'\n", output);
+            return 1;
+        }
+        int status = check_kernels(out, seed, json);
+        if (out != stdout)
+            fclose(out);
+        return status;
+    }
+
+    std::vector<result> results;
+    for (int stars : star_counts)
+    for (double accuracy : accuracies)
+    for (int threads : thread_counts)
+    for (const std::string& schedule : schedules)
+    for (const std::string& solver : solvers)
+    for (const std::string& tree_precision : tree_precisions)
+    for (const std::string& galaxy : galaxies) {
+        if (stars < 2)
+            continue;
+        results.push_back(run(stars, accuracy, threads, schedule, solver, tree_precision, galaxy, frames, warmup, seed));
+        const result& res = results.back();
+        fprintf(stderr, "%d stars, accuracy %g, %d threads, %s, %s, %s tree, %s galaxy: %.3f ms/frame, imbalance %.3f, tree %.1f MB\n",
+                stars, accuracy, threads, schedule.c_str(), solver.c_str(), tree_precision.c_str(), galaxy.c_str(),
+                1e3 * (res.build + res.accel + res.integrate), res.imbalance, res.tree_bytes / 1048576.0);
+    }
+
+    FILE* out = output ? fopen(output, "w") : stdout;
+    if (!out) {
+        fprintf(stderr, "Cannot open '%s'\n", output);
+        return 1;
+    }
+    if (json)
+        print_json(out, results, seed, frames);
+    else
+        print_csv(out, results, seed, frames);
+    if (out != stdout)
+        fclose(out);
+    return 0;
+}
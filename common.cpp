@@ -1,15 +1,17 @@
 #include <algorithm>
+#include <atomic>
 #include <cctype>
 #include <chrono>
+#include <cstdio>
 #include <fstream>
+#include <mutex>
 #include <regex>
 #include <sstream>
 #include <thread>
 #include <vector>
-#include <GLFW/glfw3.h>
 #include "common.hpp"
 
-vec2* disp_star_position = nullptr;  // display coordinates, float
+vec2* disp_star_position = nullptr;  // display coordinates, float, being written by world_frame()
 vec3* disp_star_color = nullptr;  // star colors
 
 std::string read_file(const std::string& filename)
@@ -22,17 +24,24 @@ std::string read_file(const std::string& filename)
     return content;
 }
 
+// Monotonic time in seconds; does not depend on GLFW being initialized
+double get_time()
+{
+    using namespace std::chrono;
+    return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
 // returns actual frame duration
 double frame_sleep()
 {
     static double last_time = -1.0;
     if (last_time < 0)
-        last_time = glfwGetTime() - 1.0/config.max_fps;
-    double last_interval = glfwGetTime() - last_time;
+        last_time = get_time() - 1.0/config.max_fps;
+    double last_interval = get_time() - last_time;
     double sleep_interval = 1.0/config.max_fps - last_interval;
     if (sleep_interval > 0)
         std::this_thread::sleep_for(std::chrono::microseconds((int)(1e6 * sleep_interval)));
-    last_interval = glfwGetTime() - last_time;
+    last_interval = get_time() - last_time;
     last_time += last_interval;
     add_fps(1 / last_interval);
     return last_interval;
@@ -61,17 +70,50 @@ void Config::load(const std::string& filename)
             case Parameter::stars:          config.stars          = std::stoi(value); break;
             case Parameter::galaxy_density: config.galaxy_density = std::stod(value); break;
             case Parameter::star_speed:     config.star_speed     = std::stod(value); break;
+            case Parameter::seed:           config.seed           = std::stoull(value); break;
+            case Parameter::galaxy:         config.galaxy         = value; break;
+            case Parameter::bulge_fraction: config.bulge_fraction = std::stod(value); break;
+            case Parameter::orbit_distance: config.orbit_distance = std::stod(value); break;
+            case Parameter::orbit_impact:   config.orbit_impact   = std::stod(value); break;
+            case Parameter::orbit_speed:    config.orbit_speed    = std::stod(value); break;
             case Parameter::gravity:        config.gravity        = std::stod(value); break;
             case Parameter::epsilon:        config.epsilon        = std::stod(value); break;
             case Parameter::accuracy:       config.accuracy       = std::stod(value); break;
+            case Parameter::group_size:     config.group_size     = std::stoi(value); break;
+            case Parameter::leaf_size:      config.leaf_size      = std::stoi(value); break;
+            case Parameter::multipole:      config.multipole      = std::stoi(value); break;
+            case Parameter::tree_precision: config.tree_precision = value; break;
+            case Parameter::solver:         config.solver         = value; break;
+            case Parameter::fmm_order:      config.fmm_order      = std::stoi(value); break;
+            case Parameter::fmm_theta:      config.fmm_theta      = std::stod(value); break;
+            case Parameter::refit_frames:   config.refit_frames   = std::stoi(value); break;
+            case Parameter::refit_growth:   config.refit_growth   = std::stod(value); break;
+            case Parameter::time_bins:      config.time_bins      = std::stoi(value); break;
+            case Parameter::step_accuracy:  config.step_accuracy  = std::stod(value); break;
             case Parameter::speed:          config.speed          = std::stod(value); break;
             case Parameter::min_fps:        config.min_fps        = std::stod(value); break;
+            case Parameter::threads:        config.threads        = std::stoi(value); break;
+            case Parameter::affinity:       config.affinity       = value; break;
+            case Parameter::schedule:       config.schedule       = value; break;
+            case Parameter::kernel:         config.kernel         = value; break;
+            case Parameter::precision:      config.precision      = value; break;
             case Parameter::max_fps:        config.max_fps        = std::stod(value); break;
             case Parameter::default_zoom:   config.default_zoom   = std::stod(value); break;
             case Parameter::msaa:           config.msaa           = std::stoi(value); break;
             case Parameter::show_status:    config.show_status    = IgnoreCase()(value, "true") || (value == "1"); break;
             case Parameter::font:           config.font           = value; break;
             case Parameter::text_size:      config.text_size      = std::stoi(value); break;
+            case Parameter::trace_file:     config.trace_file     = value; break;
+            case Parameter::steps:          config.steps          = std::stoi(value); break;
+            case Parameter::time_step:      config.time_step      = std::stod(value); break;
+            case Parameter::snapshot:       config.snapshot       = value; break;
+            case Parameter::snapshot_every: config.snapshot_every = std::stoi(value); break;
+            case Parameter::restart:        config.restart        = value; break;
+            case Parameter::trajectory:     config.trajectory     = value; break;
+            case Parameter::traj_every:     config.traj_every     = std::stoi(value); break;
+            case Parameter::traj_quantum:   config.traj_quantum   = std::stod(value); break;
+            case Parameter::traj_compress:  config.traj_compress  = value; break;
+            case Parameter::replay:         config.replay         = value; break;
             case Parameter::text_color:
                 std::stringstream strstr(value);
                 strstr >> config.text_color[0] >> config.text_color[1] >> config.text_color[2] >> config.text_color[3];
@@ -86,38 +128,124 @@ void Config::load(const std::string& filename)
 
 // =========================== Performance counters ===========================
 
-static std::vector<float> fps_buff(256, 0);
-static size_t fps_count = 0;
-static size_t fps_pointer = 0;
+PerfCounter perf_build;
+PerfCounter perf_accel;
+PerfCounter perf_imbalance;
+PerfCounter perf_integrate;
+PerfCounter perf_draw;
 
-// Get mean FPS among the last [frame] values
-float get_fps(size_t frame)
+static PerfCounter fps;
+
+// Append a new value, overwriting the oldest one
+void PerfCounter::add(float value)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    buff[pointer] = value;
+    pointer++;
+    pointer %= buff.size();
+    if (count < buff.size())
+        count++;
+}
+
+// Mean among the last [frames] values
+float PerfCounter::mean(size_t frames) const
 {
-    if (fps_count == 0)
+    std::lock_guard<std::mutex> lock(mutex);
+    if (count == 0)
         return 0;
-    if (frame < 1)
-        frame = 1;
-    if (frame > fps_count)
-        frame = fps_count;
+    if (frames < 1)
+        frames = 1;
+    if (frames > count)
+        frames = count;
     float sum = 0;
-    for (size_t i = (fps_pointer - frame + fps_buff.size()) % fps_buff.size();
-             i != fps_pointer; i = (i + 1) % fps_buff.size())
-        sum += fps_buff[i];
-    return sum / frame;
+    for (size_t n = 0, i = (pointer - frames + buff.size()) % buff.size();
+             n < frames; n++, i = (i + 1) % buff.size())
+        sum += buff[i];
+    return sum / frames;
+}
+
+// Maximum among the last [frames] values
+float PerfCounter::max(size_t frames) const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (count == 0)
+        return 0;
+    if (frames < 1)
+        frames = 1;
+    if (frames > count)
+        frames = count;
+    float result = buff[(pointer - 1 + buff.size()) % buff.size()];
+    for (size_t n = 0, i = (pointer - frames + buff.size()) % buff.size();
+             n < frames; n++, i = (i + 1) % buff.size())
+        result = std::max(result, buff[i]);
+    return result;
+}
+
+float PerfCounter::last() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return buff[(pointer - 1 + buff.size()) % buff.size()];
+}
+
+// Get mean FPS among the last [frame] values
+float get_fps(size_t frame)
+{
+    return fps.mean(frame);
 }
 
 // Get mean FPS for the last [period] seconds, according to the last FPS value
 float get_fps_period(float period)
 {
-    return get_fps(period * fps_buff[(fps_pointer - 1 + fps_buff.size()) % fps_buff.size()]);
+    return fps.mean(period * fps.last());
 }
 
 // Append a new FPS value
 void add_fps(float value)
 {
-    fps_buff[fps_pointer] = value;
-    fps_pointer++;
-    fps_pointer %= fps_buff.size();
-    if (fps_count < fps_buff.size())
-        fps_count++;
+    fps.add(value);
+}
+
+
+// ================================ Trace file ================================
+// Chrome trace event format, viewable in chrome://tracing or ui.perfetto.dev
+
+static FILE* trace_file = nullptr;
+static std::mutex trace_mutex;
+static double trace_start;
+static bool trace_first_event;
+
+void init_trace()
+{
+    if (config.trace_file.empty())
+        return;
+    trace_file = fopen(config.trace_file.c_str(), "w");
+    if (!trace_file) {
+        fprintf(stderr, "Cannot open trace file '%s'\n", config.trace_file.c_str());
+        return;
+    }
+    fputs("{\"traceEvents\": [\n", trace_file);
+    trace_start = get_time();
+    trace_first_event = true;
+}
+
+// Record a complete event; [start] and [end] are get_time() values
+void trace_event(const char* name, double start, double end)
+{
+    if (!trace_file)
+        return;
+    static std::atomic<int> thread_count = 0;
+    thread_local int thread = ++thread_count;
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    fprintf(trace_file, "%s{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+            trace_first_event ? "" : ",\n", name, thread, 1e6 * (start - trace_start), 1e6 * (end - start));
+    trace_first_event = false;
+}
+
+void finalize_trace()
+{
+    if (!trace_file)
+        return;
+    fputs("\n]}\n", trace_file);
+    fclose(trace_file);
+    trace_file = nullptr;
 }
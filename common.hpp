@@ -1,8 +1,10 @@
 #ifndef COMMON_H
 #define COMMON_H
 
+#include <mutex>
 #include <string>
 #include <unordered_map>
+#include <vector>
 #include "linmath.h"
 
 struct vecd2
@@ -19,11 +21,33 @@ private:
         stars,
         galaxy_density,
         star_speed,
+        seed,
+        galaxy,
+        bulge_fraction,
+        orbit_distance,
+        orbit_impact,
+        orbit_speed,
         gravity,
         epsilon,
         accuracy,
+        group_size,
+        leaf_size,
+        multipole,
+        tree_precision,
+        solver,
+        fmm_order,
+        fmm_theta,
+        refit_frames,
+        refit_growth,
+        time_bins,
+        step_accuracy,
         speed,
         min_fps,
+        threads,
+        affinity,
+        schedule,
+        kernel,
+        precision,
         max_fps,
         default_zoom,
         msaa,
@@ -31,6 +55,17 @@ private:
         font,
         text_size,
         text_color,
+        trace_file,
+        steps,
+        time_step,
+        snapshot,
+        snapshot_every,
+        restart,
+        trajectory,
+        traj_every,
+        traj_quantum,
+        traj_compress,
+        replay,
     };
 
     // Hashing and comparing std::string ignoring case
@@ -58,11 +93,33 @@ private:
             {"Stars", Parameter::stars},
             {"GalaxyDens", Parameter::galaxy_density},
             {"StarSpeed", Parameter::star_speed},
+            {"Seed", Parameter::seed},
+            {"Galaxy", Parameter::galaxy},
+            {"BulgeFraction", Parameter::bulge_fraction},
+            {"OrbitDistance", Parameter::orbit_distance},
+            {"OrbitImpact", Parameter::orbit_impact},
+            {"OrbitSpeed", Parameter::orbit_speed},
             {"Gravity", Parameter::gravity},
             {"Epsilon", Parameter::epsilon},
             {"Accuracy", Parameter::accuracy},
+            {"GroupSize", Parameter::group_size},
+            {"LeafSize", Parameter::leaf_size},
+            {"Multipole", Parameter::multipole},
+            {"TreePrecision", Parameter::tree_precision},
+            {"Solver", Parameter::solver},
+            {"FMMOrder", Parameter::fmm_order},
+            {"FMMTheta", Parameter::fmm_theta},
+            {"RefitFrames", Parameter::refit_frames},
+            {"RefitGrowth", Parameter::refit_growth},
+            {"TimeBins", Parameter::time_bins},
+            {"StepAccuracy", Parameter::step_accuracy},
             {"Speed", Parameter::speed},
             {"MinFPS", Parameter::min_fps},
+            {"Threads", Parameter::threads},
+            {"Affinity", Parameter::affinity},
+            {"Schedule", Parameter::schedule},
+            {"Kernel", Parameter::kernel},
+            {"Precision", Parameter::precision},
             {"MaxFPS", Parameter::max_fps},
             {"DefaultZoom", Parameter::default_zoom},
             {"MSAA", Parameter::msaa},
@@ -70,6 +127,17 @@ private:
             {"Font", Parameter::font},
             {"TextSize", Parameter::text_size},
             {"TextColor", Parameter::text_color},
+            {"TraceFile", Parameter::trace_file},
+            {"Steps", Parameter::steps},
+            {"TimeStep", Parameter::time_step},
+            {"Snapshot", Parameter::snapshot},
+            {"SnapshotEvery", Parameter::snapshot_every},
+            {"Restart", Parameter::restart},
+            {"Trajectory", Parameter::trajectory},
+            {"TrajEvery", Parameter::traj_every},
+            {"TrajQuantum", Parameter::traj_quantum},
+            {"TrajCompress", Parameter::traj_compress},
+            {"Replay", Parameter::replay},
     };
 
 public:
@@ -78,12 +146,34 @@ public:
     std::string filename = "constel.conf";
     int stars = 7000;
     double galaxy_density = 10;
-    double star_speed = 1.4;  // star starting speed factor
+    double star_speed = 1.4;  // star starting speed factor of the uniform galaxy
+    unsigned long long seed = 0;  // of the starting galaxy, the same for any number of threads; 0 for a new one
+    std::string galaxy = "uniform";  // starting galaxy: uniform, disk, plummer, hernquist, or collision of two disks
+    double bulge_fraction = 0.2;  // of the stars of a disk galaxy in its bulge
+    double orbit_distance = 4;  // between the colliding galaxies at the start, in galaxy radii
+    double orbit_impact = 1;  // offset of the colliding galaxies across their approach, in galaxy radii
+    double orbit_speed = 1;  // of the colliding galaxies relative to the parabolic orbit
     double gravity = 0.002;
     double epsilon = 2;  // minimum effective distance
     double accuracy = 0.7;  // minimum effective distance
+    int group_size = 32;  // maximum number of stars sharing one tree walk
+    int leaf_size = 1;  // maximum number of stars in a tree leaf, summed directly when the leaf is opened
+    int multipole = 1;  // Barnes–Hut node moments: 1 monopole, 2 quadrupole, 3 octupole
+    std::string tree_precision = "double";  // Barnes–Hut walk node data: double, or float for a smaller tree
+    std::string solver = "barnes-hut";  // force solver: barnes-hut, or fmm (fast multipole method)
+    int fmm_order = 5;  // FMM expansion order
+    double fmm_theta = 0.5;  // FMM opening parameter: sum of node radii / distance
+    int refit_frames = 0;  // maximum frames between tree rebuilds, refitting the old tree in between
+    double refit_growth = 0.1;  // relative growth of the Barnes-Hut interactions that forces a rebuild
+    int time_bins = 0;  // individual time steps down to frame_time / 2^time_bins, 0 for one shared step
+    double step_accuracy = 0.025;  // η of the individual time step criteria
     double speed = 1;  // simulation speed factor
     double min_fps = 40;  // maximum simulation frame = 1/FPS
+    int threads = 0;  // simulation threads, 0 for all cores
+    std::string affinity = "none";  // worker pinning: none, compact or scatter over NUMA nodes
+    std::string schedule = "steal";  // force pass distribution: steal, or static contiguous parts
+    std::string kernel = "auto";  // force kernel instruction set: auto, scalar, avx2, avx512
+    std::string precision = "double";  // force kernel precision: double, or float with approximate 1/r
     double max_fps = 60;
     double default_zoom = 25;
     int msaa = 0;  // anti-aliasing samples
@@ -91,20 +181,53 @@ public:
     std::string font = "/usr/share/fonts/TTF/DejaVuSansMono.ttf";
     double text_size = 14;
     vec4 text_color = { 0, 1, 0, 1 };
+    std::string trace_file;  // Chrome trace JSON with frame phase timings, none if empty
+    int steps = 1000;  // number of frames simulated in headless mode
+    double time_step = 0.025;  // fixed frame duration in headless mode
+    std::string snapshot;  // binary snapshot written at exit, none if empty
+    int snapshot_every = 0;  // frames between snapshots while running, 0 for none
+    std::string restart;  // snapshot to resume from instead of a new galaxy
+    std::string trajectory;  // star positions recorded every traj_every frames, none if empty
+    int traj_every = 10;
+    double traj_quantum = 0.001;  // position step of the recorded trajectory
+    std::string traj_compress = "lz";  // trajectory compression: none, lz (bundled), or zstd if built with it
+    std::string replay;  // trajectory played back instead of simulating, none if empty
 };
 
 extern Config config;
 
-extern vec2* disp_star_position;
+// Rolling buffer of the latest per-frame values, filled by the simulation thread and read by the renderer
+class PerfCounter
+{
+private:
+    std::vector<float> buff = std::vector<float>(256, 0);
+    size_t count = 0;
+    size_t pointer = 0;
+    mutable std::mutex mutex;
+
+public:
+    void add(float value);
+    float mean(size_t frames) const;
+    float max(size_t frames) const;
+    float last() const;
+};
+
+extern vec2* disp_star_position;  // being written by world_frame()
 extern vec3* disp_star_color;
-extern double perf_build;
-extern double perf_accel;
-extern double perf_draw;
+extern PerfCounter perf_build;  // durations of the frame phases in seconds
+extern PerfCounter perf_accel;
+extern PerfCounter perf_imbalance;  // the slowest thread's force pass time relative to the mean
+extern PerfCounter perf_integrate;
+extern PerfCounter perf_draw;
 
 std::string read_file(const std::string& filename);
+double get_time();
 double frame_sleep();
 float get_fps(size_t frame);
 float get_fps_period(float period);
 void add_fps(float value);
+void init_trace();
+void trace_event(const char* name, double start, double end);
+void finalize_trace();
 
 #endif // COMMON_H
@@ -2,7 +2,6 @@
 #include <string>
 
 #include <stdlib.h>
-#include <time.h>
 #include <GLFW/glfw3.h>
 
 #include "common.hpp"
@@ -12,31 +11,35 @@
 
 void exit_finalize(int code)
 {
+    stop_world_thread();  // it may be writing into the mapped GL buffers
     finalize_graphics();
     finalize_world();
+    finalize_trace();
     exit(code);
 }
 
 int main(int argc, char **argv)
 {
-    time_t seed = time(NULL);
-    //printf("Random seed: 0x%lx\n", seed);
-    srand(seed);
     std::string config_file;
     if (argc >= 2)
         config_file = argv[1];
     config.load(config_file);
+    init_trace();
     init_world();
     GLFWwindow* window = init_graphics();
     if (!window)
         exit_finalize(1);
     input.initialize(window);
 
-    // Main loop
+    // Main loop: the simulation runs on its own thread, the rendering here
+    start_world_thread();
     while (!glfwWindowShouldClose(window)) {
-        double time = frame_sleep();
+        frame_sleep();
         input.frame();
-        world_frame(time);
+        if (input.pause % 2)
+            pause_replay();
+        if (input.seek)
+            seek_replay(input.seek);
         draw();
     }
 
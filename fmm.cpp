@@ -0,0 +1,476 @@
+// ****************************************************************************
+// Fast multipole method on the Barnes–Hut quad-tree.
+// Cartesian Taylor expansions of the softened potential up to config.fmm_order
+// interact through a dual tree walk, after W. Dehnen, J. Comput. Phys. 179 (2002).
+// Near stars are summed directly with the force kernel.
+// ****************************************************************************
+
+#include "fmm.hpp"
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "common.hpp"
+#include "kernel.hpp"
+#include "scheduler.hpp"
+
+static const int max_order = 16;
+static const int max_terms = (max_order + 1) * (max_order + 2) / 2;
+static const int leaf_size = 32;  // nodes of at most this many stars are not split
+static const int task_size = 1024;  // target subtrees of at most this many stars are walked by one thread
+
+static int order;
+static int terms;
+static int direct_limit;  // star pairs below which direct summation beats an expansion
+
+// C(high, low) d^(high - low), for shifting expansions by d
+struct shift_term
+{
+    int high;
+    int low;
+    int diff;
+    double factor;
+};
+
+// C(local + multipole, multipole), for converting a multipole expansion to a local one
+struct m2l_term
+{
+    int local;
+    int multipole;
+    int derivative;
+    double factor;
+};
+
+static std::vector<shift_term> shift_terms;
+static std::vector<m2l_term> m2l_terms;
+static double factor_x[max_order + 1][max_order / 2 + 1];  // 1 / (a! (i - 2a)!)
+static double binomials[max_order + 1][max_order + 1];
+
+// Tree nodes down to leaf_size stars in SoA form, breadth first
+static struct fmm_array
+{
+    double* x;  // expansion center: the center of mass
+    double* y;
+    double* radius;  // of the circle around the center holding all stars
+    int* first_child;
+    int* child_count;  // zero for a leaf
+    int* begin;  // stars [begin, end)
+    int* end;
+    int* quad;  // node in the world's tree
+    int* task;  // index of the task subtree holding the node, -1 above them
+    double* multipole;  // [terms] per node: sum of m (center - star)^k
+    double* local;  // [terms] per node: potential = sum of L_n (target - center)^n
+} nodes = { 0 };
+static int node_count;
+static int node_capacity;
+
+static std::vector<int> levels;  // first node of each level
+static std::vector<int> tasks;  // roots of the task subtrees
+static std::vector<std::pair<int, int>> deferred;  // (task, source node) pairs left for the parallel walk
+static std::vector<int> pending;  // source nodes by task
+static std::vector<int> pending_begin;
+
+static ThreadPool* pool = NULL;
+static WorkQueue work;
+static const fmm_tree* tree;
+static double* accel_x;
+static double* accel_y;
+static double* thread_busy;
+static double job_start_time;
+static int level_begin;
+static int level_end;
+
+// Expansion term x^i y^j; terms are ordered by degree
+static inline int term(int i, int j)
+{
+    int degree = i + j;
+    return degree * (degree + 1) / 2 + j;
+}
+
+static inline double binomial(int n, int k)
+{
+    double result = 1;
+    for (int i = 1; i <= k; i++)
+        result = result * (n - k + i) / i;
+    return result;
+}
+
+// d^k for every term k
+static inline void powers(double dx, double dy, double* result)
+{
+    double px[max_order + 1], py[max_order + 1];
+    px[0] = py[0] = 1;
+    for (int i = 1; i <= order; i++) {
+        px[i] = px[i-1] * dx;
+        py[i] = py[i-1] * dy;
+    }
+    for (int degree = 0; degree <= order; degree++)
+        for (int j = 0; j <= degree; j++)
+            result[term(degree - j, j)] = px[degree - j] * py[j];
+}
+
+// Taylor coefficients D^k(ψ) / k! of the softened potential at (rx, ry), where ψ' = -1/(r² + ε)
+// as in the force kernels. With f(r²) = ψ(r),
+// D^(i,j) f = Σ_a Σ_b i!/(a!(i-2a)!) (2x)^(i-2a) j!/(b!(j-2b)!) (2y)^(j-2b) f^(i+j-a-b).
+// The constant term is left zero, as only the gradient is used.
+static inline void derivatives(double rx, double ry, double* result)
+{
+    double u = rx*rx + ry*ry;
+    double inv_u = 1 / u;
+    double inv_v = 1 / (u + config.epsilon);
+
+    // f' = -1/2 u^(-1/2) (u + ε)^(-1), differentiated as a product
+    double du_sqrt[max_order], dv[max_order];
+    du_sqrt[0] = sqrt(inv_u);
+    dv[0] = inv_v;
+    for (int k = 1; k < order; k++) {
+        du_sqrt[k] = du_sqrt[k-1] * (0.5 - k) * inv_u;
+        dv[k] = dv[k-1] * -k * inv_v;
+    }
+    double df[max_order + 1];
+    for (int n = 1; n <= order; n++) {
+        double sum = 0;
+        for (int k = 0; k < n; k++)
+            sum += binomials[n-1][k] * du_sqrt[k] * dv[n-1-k];
+        df[n] = -0.5 * sum;
+    }
+
+    double px[max_order + 1], py[max_order + 1];
+    px[0] = py[0] = 1;
+    for (int i = 1; i <= order; i++) {
+        px[i] = px[i-1] * 2 * rx;
+        py[i] = py[i-1] * 2 * ry;
+    }
+    result[0] = 0;
+    for (int degree = 1; degree <= order; degree++) {
+        for (int j = 0; j <= degree; j++) {
+            int i = degree - j;
+            double sum = 0;
+            for (int a = 0; 2*a <= i; a++)
+                for (int b = 0; 2*b <= j; b++)
+                    sum += factor_x[i][a] * factor_x[j][b] * px[i - 2*a] * py[j - 2*b] * df[degree - a - b];
+            result[term(i, j)] = sum;
+        }
+    }
+}
+
+static void alloc_nodes(int capacity)
+{
+    node_capacity = capacity;
+    nodes.x = (double*)realloc(nodes.x, capacity * sizeof(double));
+    nodes.y = (double*)realloc(nodes.y, capacity * sizeof(double));
+    nodes.radius = (double*)realloc(nodes.radius, capacity * sizeof(double));
+    nodes.first_child = (int*)realloc(nodes.first_child, capacity * sizeof(int));
+    nodes.child_count = (int*)realloc(nodes.child_count, capacity * sizeof(int));
+    nodes.begin = (int*)realloc(nodes.begin, capacity * sizeof(int));
+    nodes.end = (int*)realloc(nodes.end, capacity * sizeof(int));
+    nodes.quad = (int*)realloc(nodes.quad, capacity * sizeof(int));
+    nodes.task = (int*)realloc(nodes.task, capacity * sizeof(int));
+    nodes.multipole = (double*)realloc(nodes.multipole, (size_t)capacity * terms * sizeof(double));
+    nodes.local = (double*)realloc(nodes.local, (size_t)capacity * terms * sizeof(double));
+}
+
+void init_fmm(ThreadPool* thread_pool)
+{
+    pool = thread_pool;
+    work.init(pool->size());
+    order = std::clamp(config.fmm_order, 1, max_order);
+    terms = (order + 1) * (order + 2) / 2;
+    shift_terms.clear();
+    m2l_terms.clear();
+    for (int n = 0; n <= order; n++)
+        for (int k = 0; k <= n; k++)
+            binomials[n][k] = binomial(n, k);
+    for (int i = 0; i <= order; i++)
+        for (int a = 0; 2*a <= i; a++)
+            factor_x[i][a] = 1 / (tgamma(a + 1) * tgamma(i - 2*a + 1));
+    for (int high_degree = 0; high_degree <= order; high_degree++) {
+        for (int high_y = 0; high_y <= high_degree; high_y++) {
+            int high_x = high_degree - high_y;
+            for (int low_x = 0; low_x <= high_x; low_x++)
+                for (int low_y = 0; low_y <= high_y; low_y++)
+                    shift_terms.push_back({ term(high_x, high_y), term(low_x, low_y), term(high_x - low_x, high_y - low_y),
+                            binomial(high_x, low_x) * binomial(high_y, low_y) });
+            // Local terms of this degree from multipoles of up to [order - degree]
+            for (int degree = 0; degree <= order - high_degree; degree++) {
+                for (int y = 0; y <= degree; y++) {
+                    int x = degree - y;
+                    m2l_terms.push_back({ term(high_x, high_y), term(x, y), term(high_x + x, high_y + y),
+                            binomial(high_x + x, x) * binomial(high_y + y, y) });
+                }
+            }
+        }
+    }
+    direct_limit = 2 * m2l_terms.size();
+    alloc_nodes(1024);
+}
+
+void finalize_fmm()
+{
+    free(nodes.x);
+    free(nodes.y);
+    free(nodes.radius);
+    free(nodes.first_child);
+    free(nodes.child_count);
+    free(nodes.begin);
+    free(nodes.end);
+    free(nodes.quad);
+    free(nodes.task);
+    free(nodes.multipole);
+    free(nodes.local);
+    memset(&nodes, 0, sizeof(nodes));
+    node_capacity = 0;
+    pool = NULL;
+}
+
+static inline bool is_leaf(int quad)
+{
+    return tree->end[quad] - tree->begin[quad] <= leaf_size || !tree->child_count[quad];
+}
+
+static void add_node(int quad, int parent_task)
+{
+    if (node_count == node_capacity)
+        alloc_nodes(2 * node_capacity);
+    int node = node_count++;
+    nodes.x[node] = tree->x[quad];
+    nodes.y[node] = tree->y[quad];
+    nodes.begin[node] = tree->begin[quad];
+    nodes.end[node] = tree->end[quad];
+    nodes.quad[node] = quad;
+    nodes.first_child[node] = 0;
+    nodes.child_count[node] = 0;
+    if (parent_task >= 0) {
+        nodes.task[node] = parent_task;
+    } else if (tree->end[quad] - tree->begin[quad] <= task_size || is_leaf(quad)) {
+        nodes.task[node] = tasks.size();
+        tasks.push_back(node);
+    } else {
+        nodes.task[node] = -1;
+    }
+}
+
+// Copy the top of the world's tree, breadth first, down to the leaves of at most leaf_size stars
+static void copy_tree()
+{
+    node_count = 0;
+    levels.clear();
+    tasks.clear();
+    add_node(0, -1);
+    for (int begin = 0, end = 1; begin < end; begin = end, end = node_count) {
+        levels.push_back(begin);
+        for (int node = begin; node < end; node++) {
+            int quad = nodes.quad[node];
+            if (is_leaf(quad))
+                continue;
+            nodes.first_child[node] = node_count;
+            nodes.child_count[node] = tree->child_count[quad];
+            for (int child = tree->first_child[quad]; child < tree->first_child[quad] + tree->child_count[quad]; child++)
+                add_node(child, nodes.task[node]);
+        }
+    }
+    levels.push_back(node_count);
+}
+
+// Multipoles of the current level, whose children are already done
+static void upward_job(int thread)
+{
+    double d_powers[max_terms];
+    int begin, end;
+    while (work.next(thread, &begin, &end))
+    for (int node = level_begin + begin; node < level_begin + end; node++) {
+        double* multipole = &nodes.multipole[(size_t)node * terms];
+        memset(multipole, 0, terms * sizeof(double));
+        memset(&nodes.local[(size_t)node * terms], 0, terms * sizeof(double));
+        double radius = 0;
+        if (nodes.child_count[node]) {
+            for (int child = nodes.first_child[node]; child < nodes.first_child[node] + nodes.child_count[node]; child++) {
+                double dx = nodes.x[node] - nodes.x[child];
+                double dy = nodes.y[node] - nodes.y[child];
+                powers(dx, dy, d_powers);
+                const double* child_multipole = &nodes.multipole[(size_t)child * terms];
+                for (const shift_term& t : shift_terms)
+                    multipole[t.high] += t.factor * d_powers[t.diff] * child_multipole[t.low];
+                radius = std::max(radius, sqrt(dx*dx + dy*dy) + nodes.radius[child]);
+            }
+        } else {
+            for (int star = nodes.begin[node]; star < nodes.end[node]; star++) {
+                double dx = nodes.x[node] - tree->star_x[star];
+                double dy = nodes.y[node] - tree->star_y[star];
+                powers(dx, dy, d_powers);
+                for (int k = 0; k < terms; k++)
+                    multipole[k] += tree->star_mass[star] * d_powers[k];
+                radius = std::max(radius, sqrt(dx*dx + dy*dy));
+                accel_x[star] = 0;  // leaves cover every star once
+                accel_y[star] = 0;
+            }
+        }
+        nodes.radius[node] = radius;
+    }
+}
+
+static inline void direct(int source, int target)
+{
+    int begin = nodes.begin[source];
+    interaction_list list = { (double*)&tree->star_x[begin], (double*)&tree->star_y[begin], (double*)&tree->star_mass[begin],
+            nodes.end[source] - begin, 0 };
+    begin = nodes.begin[target];
+    accel_kernel(&tree->star_x[begin], &tree->star_y[begin], nodes.end[target] - begin, &list, config.epsilon,
+            &accel_x[begin], &accel_y[begin]);
+}
+
+static inline void multipole_to_local(int source, int target)
+{
+    double d[max_terms];
+    derivatives(nodes.x[target] - nodes.x[source], nodes.y[target] - nodes.y[source], d);
+    const double* multipole = &nodes.multipole[(size_t)source * terms];
+    double* local = &nodes.local[(size_t)target * terms];
+    for (const m2l_term& t : m2l_terms)
+        local[t.local] += t.factor * d[t.derivative] * multipole[t.multipole];
+}
+
+// Attraction of the source node's stars to the target node's ones. With [defer],
+// pairs whose target is in a task subtree are collected for the parallel walk instead.
+static void interact(int source, int target, std::vector<std::pair<int, int>>* defer)
+{
+    if (defer && nodes.task[target] >= 0) {
+        defer->emplace_back(nodes.task[target], source);
+        return;
+    }
+    if (source == target) {
+        if (!nodes.child_count[source]) {
+            direct(source, target);
+            return;
+        }
+        for (int i = nodes.first_child[source]; i < nodes.first_child[source] + nodes.child_count[source]; i++)
+            for (int j = nodes.first_child[source]; j < nodes.first_child[source] + nodes.child_count[source]; j++)
+                interact(i, j, defer);
+        return;
+    }
+
+    double dx = nodes.x[target] - nodes.x[source];
+    double dy = nodes.y[target] - nodes.y[source];
+    if (nodes.radius[source] + nodes.radius[target] < config.fmm_theta * sqrt(dx*dx + dy*dy)) {
+        int64_t pairs = (int64_t)(nodes.end[source] - nodes.begin[source]) * (nodes.end[target] - nodes.begin[target]);
+        if (pairs <= direct_limit)
+            direct(source, target);
+        else
+            multipole_to_local(source, target);
+        return;
+    }
+    // Split the larger node
+    bool split_source = nodes.child_count[source] &&
+            (!nodes.child_count[target] || nodes.radius[source] > nodes.radius[target]);
+    if (split_source) {
+        for (int i = nodes.first_child[source]; i < nodes.first_child[source] + nodes.child_count[source]; i++)
+            interact(i, target, defer);
+    } else if (nodes.child_count[target]) {
+        for (int i = nodes.first_child[target]; i < nodes.first_child[target] + nodes.child_count[target]; i++)
+            interact(source, i, defer);
+    } else {
+        direct(source, target);
+    }
+}
+
+// Shift the local expansion to the children
+static inline void local_to_local(int node)
+{
+    double d_powers[max_terms];
+    const double* local = &nodes.local[(size_t)node * terms];
+    for (int child = nodes.first_child[node]; child < nodes.first_child[node] + nodes.child_count[node]; child++) {
+        powers(nodes.x[child] - nodes.x[node], nodes.y[child] - nodes.y[node], d_powers);
+        double* child_local = &nodes.local[(size_t)child * terms];
+        for (const shift_term& t : shift_terms)
+            child_local[t.low] += t.factor * d_powers[t.diff] * local[t.high];
+    }
+}
+
+// Pass the local expansions down to the stars: acceleration = gradient of the potential
+static void downward(int node)
+{
+    if (nodes.child_count[node]) {
+        local_to_local(node);
+        for (int child = nodes.first_child[node]; child < nodes.first_child[node] + nodes.child_count[node]; child++)
+            downward(child);
+        return;
+    }
+    double h_powers[max_terms];
+    const double* local = &nodes.local[(size_t)node * terms];
+    for (int star = nodes.begin[node]; star < nodes.end[node]; star++) {
+        powers(tree->star_x[star] - nodes.x[node], tree->star_y[star] - nodes.y[node], h_powers);
+        double ax = 0, ay = 0;
+        for (int degree = 1; degree <= order; degree++) {
+            for (int j = 0; j <= degree; j++) {
+                int i = degree - j;
+                double l = local[term(i, j)];
+                if (i > 0)
+                    ax += i * l * h_powers[term(i-1, j)];
+                if (j > 0)
+                    ay += j * l * h_powers[term(i, j-1)];
+            }
+        }
+        accel_x[star] += ax;
+        accel_y[star] += ay;
+    }
+}
+
+static void task_job(int thread)
+{
+    int begin, end;
+    while (work.next(thread, &begin, &end))
+    for (int task = begin; task < end; task++) {
+        for (int i = pending_begin[task]; i < pending_begin[task + 1]; i++)
+            interact(pending[i], tasks[task], NULL);
+        downward(tasks[task]);
+    }
+    thread_busy[thread] = get_time() - job_start_time;
+}
+
+void fmm_accel(const fmm_tree* world_tree, double* world_accel_x, double* world_accel_y, double* busy)
+{
+    const int node_chunk = 64;
+    const int min_parallel_level = 256;  // smaller levels are not worth waking up the pool
+    tree = world_tree;
+    accel_x = world_accel_x;
+    accel_y = world_accel_y;
+    thread_busy = busy;
+    copy_tree();
+
+    // Bottom-up multipoles
+    for (int level = levels.size() - 2; level >= 0; level--) {
+        level_begin = levels[level];
+        level_end = levels[level + 1];
+        work.reset(level_end - level_begin, node_chunk);
+        if (level_end - level_begin >= min_parallel_level)
+            pool->run(upward_job);
+        else
+            upward_job(0);  // takes every chunk
+    }
+
+    // The walk above the task subtrees is serial and short
+    deferred.clear();
+    interact(0, 0, &deferred);
+    for (int node = 0; node < node_count; node++)
+        if (nodes.task[node] < 0)
+            local_to_local(node);  // breadth first, so parents come before children
+
+    // Group the deferred pairs by task, keeping their order
+    pending_begin.assign(tasks.size() + 1, 0);
+    for (const auto& pair : deferred)
+        pending_begin[pair.first + 1]++;
+    for (size_t task = 0; task < tasks.size(); task++)
+        pending_begin[task + 1] += pending_begin[task];
+    pending.resize(deferred.size());
+    std::vector<int> next(pending_begin.begin(), pending_begin.end() - 1);
+    for (const auto& pair : deferred)
+        pending[next[pair.first]++] = pair.second;
+
+    const int task_chunk = 1;
+    work.reset(tasks.size(), task_chunk);
+    job_start_time = get_time();
+    pool->run(task_job);
+}
@@ -0,0 +1,28 @@
+#ifndef FMM_H
+#define FMM_H
+
+#include "pool.hpp"
+
+// Read-only view of the world's quad-tree: children of a quad are stored consecutively,
+// and every quad holds the stars [begin, end) sorted by their Morton keys
+struct fmm_tree
+{
+    const double* x;  // center of mass
+    const double* y;
+    const int* first_child;
+    const int* child_count;
+    const int* begin;
+    const int* end;
+    const double* star_x;
+    const double* star_y;
+    const double* star_mass;
+};
+
+void init_fmm(ThreadPool* pool);
+void finalize_fmm();
+
+// Overwrite the accelerations of all stars, not multiplied by the gravitational constant;
+// [busy] receives the time until each thread ran out of work in the parallel walk
+void fmm_accel(const fmm_tree* tree, double* accel_x, double* accel_y, double* busy);
+
+#endif // FMM_H
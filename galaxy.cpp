@@ -0,0 +1,209 @@
+// ****************************************************************************
+// Starting galaxies: the uniform disk, an exponential disk with a bulge,
+// the radial mass profiles of Plummer and Hernquist spheres used in the
+// plane, and two disk galaxies on a collision orbit.
+// Rotation speeds follow the enclosed mass under the simulation's softened
+// gravity; the bulge and the spherical profiles are held up by random
+// motions of the same size.
+// ****************************************************************************
+
+#include "galaxy.hpp"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "common.hpp"
+
+enum galaxy_model
+{
+    model_uniform,
+    model_disk,
+    model_plummer,
+    model_hernquist,
+    model_collision,
+};
+
+static const double mean_mass = 5.5;  // of the star masses, uniform in [1, 10)
+static const double max_fraction = 0.99;  // of the mass of a profile that is drawn, cutting off its tail
+
+static galaxy_model model;
+static uint64_t seed_bits;
+static int galaxy_stars;  // in one galaxy
+static double radius;  // of the uniform disk of these stars; the scale of the other models
+static double center[2][2];  // of the colliding galaxies
+static double orbit_speed[2][2];
+
+// SplitMix64 finalizer
+static inline uint64_t mix_bits(uint64_t x)
+{
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EB;
+    return x ^ (x >> 31);
+}
+
+// Counter-based random number in [min, max): the [draw]th of the star
+static inline double star_random(int star, int draw, double min, double max)
+{
+    const int draws = 8;  // per star
+    uint64_t bits = mix_bits(seed_bits + 0x9E3779B97F4A7C15 * ((uint64_t)star * draws + draw + 1));
+    return (bits >> 11) * 0x1p-53 * (max - min) + min;
+}
+
+// Standard normal random number from the [draw]th and the next draw of the star (Box–Muller)
+static inline double star_gaussian(int star, int draw)
+{
+    double u = star_random(star, draw, 0, 1);
+    double v = star_random(star, draw + 1, 0, 1);
+    return sqrt(-2 * log(1 - u)) * cos(2*M_PI * v);
+}
+
+// Mass fractions within the radius [r] of the profiles with the scale [a]
+
+static inline double exponential_mass(double r, double a)
+{
+    return 1 - (1 + r/a) * exp(-r/a);
+}
+
+static inline double plummer_mass(double r, double a)
+{
+    return r*r*r / pow(r*r + a*a, 1.5);
+}
+
+static inline double hernquist_mass(double r, double a)
+{
+    return r*r / ((r + a) * (r + a));
+}
+
+// Radii within which the profiles hold the mass fraction [u]
+
+static inline double exponential_radius(double u, double a)
+{
+    double x = 1.68;  // the median
+    for (int i = 0; i < 32; i++) {  // Newton's method on an S-shaped function, kept positive
+        double step = (exponential_mass(x, 1) - u) / (x * exp(-x));
+        double next = x - step > 0 ? x - step : x / 2;
+        if (fabs(next - x) <= 1e-12 * x) {
+            x = next;
+            break;
+        }
+        x = next;
+    }
+    return a * x;
+}
+
+static inline double plummer_radius(double u, double a)
+{
+    return a / sqrt(pow(u, -2.0/3) - 1);
+}
+
+static inline double hernquist_radius(double u, double a)
+{
+    return a * sqrt(u) / (1 - sqrt(u));
+}
+
+// Scales of the disk galaxy: the exponential disk and its Hernquist bulge
+static inline double disk_scale() { return radius / 3; }
+static inline double bulge_scale() { return radius / 12; }
+
+// Speed of a circular orbit at the radius [r] around [mass] of which the fraction [fraction] is inside
+static inline double circular_speed(double r, double mass, double fraction)
+{
+    return sqrt(config.gravity * mass * fraction * r / (r*r + config.epsilon));
+}
+
+void init_galaxy()
+{
+    if (config.galaxy == "disk") {
+        model = model_disk;
+    } else if (config.galaxy == "plummer") {
+        model = model_plummer;
+    } else if (config.galaxy == "hernquist") {
+        model = model_hernquist;
+    } else if (config.galaxy == "collision") {
+        model = model_collision;
+    } else {
+        if (config.galaxy != "uniform")
+            fprintf(stderr, "Unknown galaxy '%s'\n", config.galaxy.c_str());
+        model = model_uniform;
+    }
+    seed_bits = mix_bits(config.seed);
+    galaxy_stars = model == model_collision ? config.stars / 2 : config.stars;
+    radius = sqrt(galaxy_stars) / config.galaxy_density;
+    if (model != model_collision)
+        return;
+
+    // Both galaxies approach along x from [orbit_distance] apart, offset by [orbit_impact] in y,
+    // with [orbit_speed] of the parabolic speed of two point masses at that distance
+    double distance = config.orbit_distance * radius;
+    double impact = config.orbit_impact * radius;
+    double separation = sqrt(distance*distance + impact*impact);
+    double speed = config.orbit_speed * sqrt(2 * config.gravity * mean_mass * config.stars / separation);
+    for (int galaxy = 0; galaxy < 2; galaxy++) {
+        double side = galaxy ? 1 : -1;
+        center[galaxy][0] = side * distance / 2;
+        center[galaxy][1] = side * impact / 2;
+        orbit_speed[galaxy][0] = -side * speed / 2;
+        orbit_speed[galaxy][1] = 0;
+    }
+}
+
+galaxy_star make_star(int index)
+{
+    galaxy_star star;
+    double r, dir;
+    if (model == model_uniform) {
+        r = star_random(index, 0, 0, radius);
+        dir = star_random(index, 1, 0, 2*M_PI);
+        star.x = r * cos(dir);
+        star.y = r * sin(dir);
+        star.speed_x =  config.star_speed * pow(r, 0.25) * sin(dir);
+        star.speed_y = -config.star_speed * pow(r, 0.25) * cos(dir);
+        star.mass = star_random(index, 2, 1, 10);
+        return star;
+    }
+
+    double u = star_random(index, 0, 0, max_fraction);
+    dir = star_random(index, 1, 0, 2*M_PI);
+    star.mass = star_random(index, 2, 1, 10);
+    double mass = mean_mass * galaxy_stars;
+    double fraction;  // of the mass inside r
+    bool rotating = true;
+    switch (model) {
+    case model_plummer:
+        r = plummer_radius(u, radius / 3);
+        fraction = plummer_mass(r, radius / 3);
+        rotating = false;
+        break;
+    case model_hernquist:
+        r = hernquist_radius(u, radius / 4);
+        fraction = hernquist_mass(r, radius / 4);
+        rotating = false;
+        break;
+    default:  // a disk galaxy
+        rotating = star_random(index, 3, 0, 1) >= config.bulge_fraction;
+        r = rotating ? exponential_radius(u, disk_scale()) : hernquist_radius(u, bulge_scale());
+        fraction = (1 - config.bulge_fraction) * exponential_mass(r, disk_scale())
+                + config.bulge_fraction * hernquist_mass(r, bulge_scale());
+        break;
+    }
+    star.x = r * cos(dir);
+    star.y = r * sin(dir);
+    double speed = circular_speed(r, mass, fraction);
+    if (rotating) {  // clockwise, as the uniform disk
+        star.speed_x =  speed * sin(dir);
+        star.speed_y = -speed * cos(dir);
+    } else {  // isotropic, with the mean square speed of the circular orbit
+        star.speed_x = speed / M_SQRT2 * star_gaussian(index, 4);
+        star.speed_y = speed / M_SQRT2 * star_gaussian(index, 6);
+    }
+
+    if (model == model_collision) {
+        int galaxy = index >= galaxy_stars;
+        star.x += center[galaxy][0];
+        star.y += center[galaxy][1];
+        star.speed_x += orbit_speed[galaxy][0];
+        star.speed_y += orbit_speed[galaxy][1];
+    }
+    return star;
+}
@@ -0,0 +1,21 @@
+#ifndef GALAXY_H
+#define GALAXY_H
+
+struct galaxy_star
+{
+    double x;
+    double y;
+    double speed_x;
+    double speed_y;
+    double mass;
+};
+
+// Pick the model of config.galaxy for the current config.stars and config.seed;
+// an unknown model falls back to the uniform disk with an error message
+void init_galaxy();
+
+// Star [index] of the starting galaxy. It depends only on the index and the seed, so the stars can be
+// made in any order and by any thread.
+galaxy_star make_star(int index);
+
+#endif // GALAXY_H
@@ -14,6 +14,7 @@
 #include "common.hpp"
 #include "input.hpp"
 #include "linmath.h"
+#include "world.hpp"
 
 #define ZOOM_SENSITIVITY 1.2
 
@@ -221,8 +222,8 @@ static void draw_text(struct font* font, int x, int y, enum align align, const c
     glUniform1i(text_texture_uniform, 0);
     glUniform2fv(text_pos_uniform, 1, text_pos);
     glEnableVertexAttribArray(text_char_pos_attrib);
-    glVertexAttribPointer(text_char_pos_attrib, 4, GL_FLOAT, GL_FALSE, 0, 0);
     glBindBuffer(GL_ARRAY_BUFFER, text_vbo);
+    glVertexAttribPointer(text_char_pos_attrib, 4, GL_FLOAT, GL_FALSE, 0, 0);
     glBufferData(GL_ARRAY_BUFFER, sizeof(coords), coords, GL_DYNAMIC_DRAW);
     glDrawArrays(GL_TRIANGLES, 0, n);
     glDisableVertexAttribArray(text_char_pos_attrib);
@@ -319,6 +320,9 @@ static GLint star_position_attribute = GL_INVALID_VALUE;
 static GLint star_color_attribute = GL_INVALID_VALUE;
 static GLuint star_position_vbo = GL_INVALID_VALUE;
 static GLuint star_color_vbo = GL_INVALID_VALUE;
+static vec2* star_position_map = NULL;  // persistently mapped ring of 3 position buffers; NULL without ARB_buffer_storage
+static GLsync star_position_fences[3] = { 0 };  // the last draw from each buffer of the ring
+static const vec2* star_positions = NULL;  // being drawn
 
 // Log the latest error associated with the object
 static void gl_log(GLuint object)
@@ -471,6 +475,18 @@ void finalize_graphics()
         glDeleteProgram(text_shader);
         text_shader = GL_INVALID_VALUE;
     }
+    for (int i = 0; i < 3; i++) {
+        if (star_position_fences[i]) {
+            glDeleteSync(star_position_fences[i]);
+            star_position_fences[i] = 0;
+        }
+    }
+    star_positions = NULL;
+    if (star_position_map) {
+        glBindBuffer(GL_ARRAY_BUFFER, star_position_vbo);
+        glUnmapBuffer(GL_ARRAY_BUFFER);
+        star_position_map = NULL;
+    }
     if (star_position_vbo != GL_INVALID_VALUE) {
         glDeleteBuffers(1, &star_position_vbo);
         star_position_vbo = GL_INVALID_VALUE;
@@ -554,15 +570,33 @@ GLFWwindow* init_graphics()
     star_position_attribute = glGetAttribLocation(star_shader, "star_position");
     star_color_attribute = glGetAttribLocation(star_shader, "star_color");
 
+    // The simulation writes the positions straight into a persistently mapped ring of buffers if possible,
+    // otherwise draw() uploads them into an orphaned buffer every frame
     glGenBuffers(1, &star_position_vbo);
     glBindBuffer(GL_ARRAY_BUFFER, star_position_vbo);
     glVertexAttribDivisor(star_position_attribute, 1);
+    if (GLEW_ARB_buffer_storage) {
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        GLsizeiptr size = 3 * sizeof(vec2) * config.stars;
+        glBufferStorage(GL_ARRAY_BUFFER, size, NULL, flags | GL_CLIENT_STORAGE_BIT);
+        star_position_map = (vec2*)glMapBufferRange(GL_ARRAY_BUFFER, 0, size, flags);
+        if (star_position_map) {
+            vec2* buffers[3] = { star_position_map, star_position_map + config.stars, star_position_map + 2*config.stars };
+            use_star_position_buffers(buffers);
+        }
+    }
+    if (!star_position_map) {
+        glDeleteBuffers(1, &star_position_vbo);  // immutable if glBufferStorage succeeded without the mapping
+        glGenBuffers(1, &star_position_vbo);
+        glBindBuffer(GL_ARRAY_BUFFER, star_position_vbo);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(vec2) * config.stars, NULL, GL_STREAM_DRAW);
+    }
 
     glGenBuffers(1, &star_color_vbo);
-    glVertexAttribDivisor(star_color_attribute, 1);
-    glVertexAttribPointer(star_color_attribute, 3, GL_FLOAT, GL_FALSE, 0, NULL);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(vec3) * config.stars, disp_star_color, GL_STATIC_DRAW);
     glBindBuffer(GL_ARRAY_BUFFER, star_color_vbo);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(vec3) * config.stars, disp_star_color, GL_STATIC_DRAW);
+    glVertexAttribPointer(star_color_attribute, 3, GL_FLOAT, GL_FALSE, 0, NULL);
+    glVertexAttribDivisor(star_color_attribute, 1);
     glEnableVertexAttribArray(star_color_attribute);
 
     glGenTextures(1, &star_texture);
@@ -606,6 +640,8 @@ GLFWwindow* init_graphics()
 
 void draw()
 {
+    double perf_start = get_time();
+
     // Update window and client area state
     if (input.double_click || input.f % 2 || (maximized != glfwGetWindowAttrib(window, GLFW_MAXIMIZED)))
         update_window();
@@ -618,10 +654,47 @@ void draw()
     glBlendFunc(GL_SRC_ALPHA, GL_ONE);
     glUseProgram(star_shader);
     glEnableVertexAttribArray(star_position_attribute);
-    glVertexAttribPointer(star_position_attribute, 2, GL_FLOAT, GL_FALSE, 0, NULL);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(vec2) * config.stars, disp_star_position, GL_STREAM_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, star_position_vbo);
+    bool fresh = !star_positions || fresh_star_positions();
+    int ring_index = 0;
+    if (star_position_map) {
+        if (fresh && star_positions) {
+            // The buffer goes back to the simulation, which must not overwrite it before the GPU is done
+            GLsync* fence = &star_position_fences[(star_positions - star_position_map) / config.stars];
+            if (*fence) {
+                GLenum wait = glClientWaitSync(*fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+                if (wait == GL_ALREADY_SIGNALED || wait == GL_CONDITION_SATISFIED) {
+                    glDeleteSync(*fence);
+                    *fence = 0;
+                } else {
+                    fresh = false;  // still being read; draw it again and hand it back in a later frame
+                }
+            }
+        }
+        if (fresh)
+            star_positions = acquire_star_positions();
+        ring_index = (star_positions - star_position_map) / config.stars;
+        glVertexAttribPointer(star_position_attribute, 2, GL_FLOAT, GL_FALSE, 0,
+                (const void*)(ring_index * sizeof(vec2) * config.stars));
+    } else {
+        if (fresh) {
+            star_positions = acquire_star_positions();
+            glBufferData(GL_ARRAY_BUFFER, sizeof(vec2) * config.stars, NULL, GL_STREAM_DRAW);  // orphan
+            glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(vec2) * config.stars, star_positions);
+        }
+        glVertexAttribPointer(star_position_attribute, 2, GL_FLOAT, GL_FALSE, 0, NULL);
+    }
+    double perf_upload_end = get_time();
+    trace_event("upload", perf_start, perf_upload_end);
     glBindTexture(GL_TEXTURE_2D, star_texture);
     glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, config.stars);
+    if (star_position_map) {
+        if (star_position_fences[ring_index])
+            glDeleteSync(star_position_fences[ring_index]);
+        star_position_fences[ring_index] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+    double perf_stars_end = get_time();
+    trace_event("draw stars", perf_upload_end, perf_stars_end);
 
     // Draw text
     if (config.show_status) {
@@ -632,14 +705,32 @@ void draw()
             snprintf(zoom_text, sizeof(zoom_text), "%.0fx", zoom/config.default_zoom);
         else
             snprintf(zoom_text, sizeof(zoom_text), "1:%.0f", (float)config.default_zoom/zoom);
+        const int frames = 64;
+        size_t tree_used, tree_peak;
+        tree_memory(&tree_used, &tree_peak);
         draw_text(font, win_width - font->chars[' '].dx, font->chars[' '].dx/2, align_top_right,
                 "X: %.2f  Y: %.2f\n"
                 "Zoom: %s\n"
-                "%.0f FPS",
+                "Time: %.2f\n"
+                "%.0f FPS\n"
+                "Build: %5.2f ms (max %5.2f)\n"
+                "Accel: %5.2f ms (max %5.2f)\n"
+                "Integrate: %5.2f ms (max %5.2f)\n"
+                "Draw: %5.2f ms (max %5.2f)\n"
+                "Tree: %.1f MB (peak %.1f)",
                 view_center[0], view_center[1],
                 zoom_text,
-                get_fps_period(1)+0.5f);
+                star_positions_time(),
+                get_fps_period(1)+0.5f,
+                1e3 * perf_build.mean(frames), 1e3 * perf_build.max(frames),
+                1e3 * perf_accel.mean(frames), 1e3 * perf_accel.max(frames),
+                1e3 * perf_integrate.mean(frames), 1e3 * perf_integrate.max(frames),
+                1e3 * perf_draw.mean(frames), 1e3 * perf_draw.max(frames),
+                tree_used / 1048576.0, tree_peak / 1048576.0);
     }
+    double perf_text_end = get_time();
+    trace_event("draw text", perf_stars_end, perf_text_end);
+    perf_draw.add(perf_text_end - perf_start);
 
     glfwSwapBuffers(window);
 }
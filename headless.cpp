@@ -0,0 +1,41 @@
+// ****************************************************************************
+// Batch simulation without a window: runs a fixed number of frames
+// with a fixed time step as fast as the CPU allows.
+// ****************************************************************************
+
+#include <algorithm>
+#include <string>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "common.hpp"
+#include "world.hpp"
+
+int main(int argc, char **argv)
+{
+    std::string config_file;
+    if (argc >= 2)
+        config_file = argv[1];
+    config.load(config_file);
+    if (argc >= 3)
+        config.steps = atoi(argv[2]);
+    if (argc >= 4)
+        config.time_step = atof(argv[3]);
+    init_trace();
+    init_world();
+
+    double start = get_time();
+    for (int i = 0; i < config.steps; i++)
+        world_frame(config.time_step);
+    double elapsed = get_time() - start;
+
+    printf("%d stars, %d frames in %.3f s: %.2f frames/s\n",
+            config.stars, config.steps, elapsed, config.steps / elapsed);
+    printf("build %.3f ms, accel %.3f ms, integrate %.3f ms per frame (last %d frames)\n",
+            1e3 * perf_build.mean(config.steps), 1e3 * perf_accel.mean(config.steps),
+            1e3 * perf_integrate.mean(config.steps), std::min(config.steps, 256));
+    finalize_world();
+    finalize_trace();
+    return 0;
+}
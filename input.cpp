@@ -35,6 +35,20 @@ void Input::glfw_key(GLFWwindow* window, int key, int scancode, int action, int
         if (pressed)
             input.f++;
         break;
+    case GLFW_KEY_SPACE:
+        if (pressed)
+            input.pause++;
+        break;
+    case GLFW_KEY_COMMA:
+    case GLFW_KEY_PERIOD:
+        if (pressed)
+            input.seek += key == GLFW_KEY_PERIOD ? 1 : -1;
+        break;
+    case GLFW_KEY_PAGE_UP:
+    case GLFW_KEY_PAGE_DOWN:
+        if (pressed)
+            input.seek += key == GLFW_KEY_PAGE_DOWN ? seek_page : -seek_page;
+        break;
     case GLFW_KEY_ESCAPE:
     case GLFW_KEY_Q:
         if (pressed && !mods)
@@ -112,6 +126,8 @@ void Input::frame()
     scroll = 0;
     double_click = false;
     f = 0;
+    pause = 0;
+    seek = 0;
 
     glfwPollEvents();
 
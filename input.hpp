@@ -9,6 +9,7 @@ class Input
 private:
     static constexpr double double_click_interval = 0.5;  // maximum double click interval in seconds
     static const int double_click_tolerance = 4;  // maximum double click mouse slip in pixels
+    static const int seek_page = 64;  // recorded frames skipped by Page Up and Page Down
 
     // GLFW callbacks
     static void glfw_key(GLFWwindow* window, int key, int scancode, int action, int mods);
@@ -37,6 +38,8 @@ public:
     bool mouse_right;
     bool double_click;
     int f;
+    int pause;  // replay pause toggles
+    int seek;  // recorded frames to move the replay by
     double scroll;
     int panx;
     int pany;
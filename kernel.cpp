@@ -0,0 +1,550 @@
+// ****************************************************************************
+// Gravity kernels: a group of stars against an interaction list.
+// The SIMD variant is chosen at runtime according to the CPU.
+// ****************************************************************************
+
+#include "kernel.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+#include <immintrin.h>
+#include "common.hpp"
+
+void grow_interaction_list(interaction_list* list)
+{
+    list->capacity = list->capacity ? 2 * list->capacity : 1024;
+    list->x = (double*)realloc(list->x, list->capacity * sizeof(double));
+    list->y = (double*)realloc(list->y, list->capacity * sizeof(double));
+    list->mass = (double*)realloc(list->mass, list->capacity * sizeof(double));
+}
+
+void free_interaction_list(interaction_list* list)
+{
+    free(list->x);
+    free(list->y);
+    free(list->mass);
+    memset(list, 0, sizeof(*list));
+}
+
+void grow_moment_list(moment_list* list)
+{
+    list->capacity = list->capacity ? 2 * list->capacity : 1024;
+    for (double** column : { &list->x, &list->y, &list->qxx, &list->qxy, &list->qyy,
+            &list->oxxx, &list->oxxy, &list->oxyy, &list->oyyy })
+        *column = (double*)realloc(*column, list->capacity * sizeof(double));
+}
+
+void free_moment_list(moment_list* list)
+{
+    for (double* column : { list->x, list->y, list->qxx, list->qxy, list->qyy,
+            list->oxxx, list->oxxy, list->oxyy, list->oyyy })
+        free(column);
+    memset(list, 0, sizeof(*list));
+}
+
+// The implementation before vector kernels, kept as the accuracy reference
+static void accel_reference(const double* x, const double* y, int count, const interaction_list* list,
+        double epsilon, double* accel_x, double* accel_y)
+{
+    for (int i = 0; i < count; i++) {
+        for (int j = 0; j < list->count; j++) {
+            double dx = list->x[j] - x[i];
+            double dy = list->y[j] - y[i];
+            double distance_sqr = dx*dx + dy*dy;
+            if (distance_sqr > 0) {
+                double angle = atan2(dy, dx);
+                double accel_abs = list->mass[j] / (distance_sqr + epsilon);
+                accel_x[i] += accel_abs * cos(angle);
+                accel_y[i] += accel_abs * sin(angle);
+            }
+        }
+    }
+}
+
+// a = m/(r² + ε) in the direction of the source
+static void accel_scalar(const double* x, const double* y, int count, const interaction_list* list,
+        double epsilon, double* accel_x, double* accel_y)
+{
+    for (int i = 0; i < count; i++) {
+        double ax = 0;
+        double ay = 0;
+        for (int j = 0; j < list->count; j++) {
+            double dx = list->x[j] - x[i];
+            double dy = list->y[j] - y[i];
+            double distance_sqr = dx*dx + dy*dy;
+            if (distance_sqr > 0) {
+                double factor = list->mass[j] / ((distance_sqr + epsilon) * sqrt(distance_sqr));
+                ax += factor * dx;
+                ay += factor * dy;
+            }
+        }
+        accel_x[i] += ax;
+        accel_y[i] += ay;
+    }
+}
+
+__attribute__((target("avx2,fma")))
+static void accel_avx2(const double* x, const double* y, int count, const interaction_list* list,
+        double epsilon, double* accel_x, double* accel_y)
+{
+    const __m256d eps = _mm256_set1_pd(epsilon);
+    const __m256d zero = _mm256_setzero_pd();
+    int vector_count = list->count & ~0x3;
+    for (int i = 0; i < count; i++) {
+        __m256d tx = _mm256_set1_pd(x[i]);
+        __m256d ty = _mm256_set1_pd(y[i]);
+        __m256d ax = zero;
+        __m256d ay = zero;
+        for (int j = 0; j < vector_count; j += 4) {
+            __m256d dx = _mm256_sub_pd(_mm256_loadu_pd(&list->x[j]), tx);
+            __m256d dy = _mm256_sub_pd(_mm256_loadu_pd(&list->y[j]), ty);
+            __m256d distance_sqr = _mm256_fmadd_pd(dx, dx, _mm256_mul_pd(dy, dy));
+            __m256d denominator = _mm256_mul_pd(_mm256_add_pd(distance_sqr, eps), _mm256_sqrt_pd(distance_sqr));
+            __m256d factor = _mm256_div_pd(_mm256_loadu_pd(&list->mass[j]), denominator);
+            factor = _mm256_and_pd(factor, _mm256_cmp_pd(distance_sqr, zero, _CMP_GT_OQ));
+            ax = _mm256_fmadd_pd(factor, dx, ax);
+            ay = _mm256_fmadd_pd(factor, dy, ay);
+        }
+        double sum_x[4], sum_y[4];
+        _mm256_storeu_pd(sum_x, ax);
+        _mm256_storeu_pd(sum_y, ay);
+        double tail_x = 0;
+        double tail_y = 0;
+        interaction_list tail = { &list->x[vector_count], &list->y[vector_count], &list->mass[vector_count],
+                list->count - vector_count, 0 };
+        accel_scalar(&x[i], &y[i], 1, &tail, epsilon, &tail_x, &tail_y);
+        accel_x[i] += (sum_x[0] + sum_x[1]) + (sum_x[2] + sum_x[3]) + tail_x;
+        accel_y[i] += (sum_y[0] + sum_y[1]) + (sum_y[2] + sum_y[3]) + tail_y;
+    }
+}
+
+__attribute__((target("avx512f")))
+static void accel_avx512(const double* x, const double* y, int count, const interaction_list* list,
+        double epsilon, double* accel_x, double* accel_y)
+{
+    const __m512d eps = _mm512_set1_pd(epsilon);
+    const __m512d zero = _mm512_setzero_pd();
+    for (int i = 0; i < count; i++) {
+        __m512d tx = _mm512_set1_pd(x[i]);
+        __m512d ty = _mm512_set1_pd(y[i]);
+        __m512d ax = zero;
+        __m512d ay = zero;
+        for (int j = 0; j < list->count; j += 8) {
+            __mmask8 lanes = list->count - j >= 8 ? 0xFF : (1 << (list->count - j)) - 1;
+            __m512d dx = _mm512_sub_pd(_mm512_maskz_loadu_pd(lanes, &list->x[j]), tx);
+            __m512d dy = _mm512_sub_pd(_mm512_maskz_loadu_pd(lanes, &list->y[j]), ty);
+            __m512d distance_sqr = _mm512_fmadd_pd(dx, dx, _mm512_mul_pd(dy, dy));
+            lanes &= _mm512_cmp_pd_mask(distance_sqr, zero, _CMP_GT_OQ);
+            __m512d denominator = _mm512_mul_pd(_mm512_add_pd(distance_sqr, eps), _mm512_sqrt_pd(distance_sqr));
+            __m512d factor = _mm512_maskz_div_pd(lanes, _mm512_maskz_loadu_pd(lanes, &list->mass[j]), denominator);
+            ax = _mm512_fmadd_pd(factor, dx, ax);
+            ay = _mm512_fmadd_pd(factor, dy, ay);
+        }
+        accel_x[i] += _mm512_reduce_add_pd(ax);
+        accel_y[i] += _mm512_reduce_add_pd(ay);
+    }
+}
+
+
+// Fast precision: coordinate differences and sums are double, while 1/r and 1/(r² + ε)
+// are single precision approximations refined with one Newton step.
+
+static void accel_scalar_float(const double* x, const double* y, int count, const interaction_list* list,
+        double epsilon, double* accel_x, double* accel_y)
+{
+    float eps = epsilon;
+    for (int i = 0; i < count; i++) {
+        double ax = 0;
+        double ay = 0;
+        for (int j = 0; j < list->count; j++) {
+            double dx = list->x[j] - x[i];
+            double dy = list->y[j] - y[i];
+            float distance_sqr = (float)dx*(float)dx + (float)dy*(float)dy;
+            if (distance_sqr > 0) {
+                float factor = (float)list->mass[j] / (sqrtf(distance_sqr) * (distance_sqr + eps));
+                ax += factor * dx;
+                ay += factor * dy;
+            }
+        }
+        accel_x[i] += ax;
+        accel_y[i] += ay;
+    }
+}
+
+// m/(r(r² + ε)) for 8 lanes
+__attribute__((target("avx2,fma")))
+static inline __m256 factor_avx2(__m256 distance_sqr, __m256 mass, __m256 eps)
+{
+    const __m256 half = _mm256_set1_ps(0.5f);
+    const __m256 three_halves = _mm256_set1_ps(1.5f);
+    const __m256 two = _mm256_set1_ps(2.0f);
+    __m256 inv_r = _mm256_rsqrt_ps(distance_sqr);
+    inv_r = _mm256_mul_ps(inv_r, _mm256_fnmadd_ps(_mm256_mul_ps(half, distance_sqr), _mm256_mul_ps(inv_r, inv_r), three_halves));
+    __m256 softened = _mm256_add_ps(distance_sqr, eps);
+    __m256 inv_softened = _mm256_rcp_ps(softened);
+    inv_softened = _mm256_mul_ps(inv_softened, _mm256_fnmadd_ps(softened, inv_softened, two));
+    __m256 factor = _mm256_mul_ps(mass, _mm256_mul_ps(inv_r, inv_softened));
+    return _mm256_and_ps(factor, _mm256_cmp_ps(distance_sqr, _mm256_setzero_ps(), _CMP_GT_OQ));
+}
+
+__attribute__((target("avx2,fma")))
+static void accel_avx2_float(const double* x, const double* y, int count, const interaction_list* list,
+        double epsilon, double* accel_x, double* accel_y)
+{
+    const __m256 eps = _mm256_set1_ps(epsilon);
+    int vector_count = list->count & ~0x7;
+    for (int i = 0; i < count; i++) {
+        __m256d tx = _mm256_set1_pd(x[i]);
+        __m256d ty = _mm256_set1_pd(y[i]);
+        __m256d ax = _mm256_setzero_pd();
+        __m256d ay = _mm256_setzero_pd();
+        for (int j = 0; j < vector_count; j += 8) {
+            __m256d dx_low = _mm256_sub_pd(_mm256_loadu_pd(&list->x[j]), tx);
+            __m256d dx_high = _mm256_sub_pd(_mm256_loadu_pd(&list->x[j + 4]), tx);
+            __m256d dy_low = _mm256_sub_pd(_mm256_loadu_pd(&list->y[j]), ty);
+            __m256d dy_high = _mm256_sub_pd(_mm256_loadu_pd(&list->y[j + 4]), ty);
+            __m256 dx = _mm256_set_m128(_mm256_cvtpd_ps(dx_high), _mm256_cvtpd_ps(dx_low));
+            __m256 dy = _mm256_set_m128(_mm256_cvtpd_ps(dy_high), _mm256_cvtpd_ps(dy_low));
+            __m256 mass = _mm256_set_m128(_mm256_cvtpd_ps(_mm256_loadu_pd(&list->mass[j + 4])),
+                    _mm256_cvtpd_ps(_mm256_loadu_pd(&list->mass[j])));
+            __m256 factor = factor_avx2(_mm256_fmadd_ps(dx, dx, _mm256_mul_ps(dy, dy)), mass, eps);
+            __m256d factor_low = _mm256_cvtps_pd(_mm256_castps256_ps128(factor));
+            __m256d factor_high = _mm256_cvtps_pd(_mm256_extractf128_ps(factor, 1));
+            ax = _mm256_fmadd_pd(factor_low, dx_low, _mm256_fmadd_pd(factor_high, dx_high, ax));
+            ay = _mm256_fmadd_pd(factor_low, dy_low, _mm256_fmadd_pd(factor_high, dy_high, ay));
+        }
+        double sum_x[4], sum_y[4];
+        _mm256_storeu_pd(sum_x, ax);
+        _mm256_storeu_pd(sum_y, ay);
+        double tail_x = 0;
+        double tail_y = 0;
+        interaction_list tail = { &list->x[vector_count], &list->y[vector_count], &list->mass[vector_count],
+                list->count - vector_count, 0 };
+        accel_scalar_float(&x[i], &y[i], 1, &tail, epsilon, &tail_x, &tail_y);
+        accel_x[i] += (sum_x[0] + sum_x[1]) + (sum_x[2] + sum_x[3]) + tail_x;
+        accel_y[i] += (sum_y[0] + sum_y[1]) + (sum_y[2] + sum_y[3]) + tail_y;
+    }
+}
+
+__attribute__((target("avx512f,avx512dq")))
+static void accel_avx512_float(const double* x, const double* y, int count, const interaction_list* list,
+        double epsilon, double* accel_x, double* accel_y)
+{
+    const __m512 eps = _mm512_set1_ps(epsilon);
+    const __m512 half = _mm512_set1_ps(0.5f);
+    const __m512 three_halves = _mm512_set1_ps(1.5f);
+    const __m512 two = _mm512_set1_ps(2.0f);
+    for (int i = 0; i < count; i++) {
+        __m512d tx = _mm512_set1_pd(x[i]);
+        __m512d ty = _mm512_set1_pd(y[i]);
+        __m512d ax = _mm512_setzero_pd();
+        __m512d ay = _mm512_setzero_pd();
+        for (int j = 0; j < list->count; j += 16) {
+            int left = list->count - j;
+            __mmask16 lanes = left >= 16 ? 0xFFFF : (1 << left) - 1;
+            __mmask8 low = lanes & 0xFF;
+            __mmask8 high = lanes >> 8;
+            __m512d dx_low = _mm512_sub_pd(_mm512_maskz_loadu_pd(low, &list->x[j]), tx);
+            __m512d dx_high = _mm512_sub_pd(_mm512_maskz_loadu_pd(high, &list->x[j + 8]), tx);
+            __m512d dy_low = _mm512_sub_pd(_mm512_maskz_loadu_pd(low, &list->y[j]), ty);
+            __m512d dy_high = _mm512_sub_pd(_mm512_maskz_loadu_pd(high, &list->y[j + 8]), ty);
+            __m512 dx = _mm512_insertf32x8(_mm512_castps256_ps512(_mm512_cvtpd_ps(dx_low)), _mm512_cvtpd_ps(dx_high), 1);
+            __m512 dy = _mm512_insertf32x8(_mm512_castps256_ps512(_mm512_cvtpd_ps(dy_low)), _mm512_cvtpd_ps(dy_high), 1);
+            __m512 mass = _mm512_insertf32x8(
+                    _mm512_castps256_ps512(_mm512_cvtpd_ps(_mm512_maskz_loadu_pd(low, &list->mass[j]))),
+                    _mm512_cvtpd_ps(_mm512_maskz_loadu_pd(high, &list->mass[j + 8])), 1);
+            __m512 distance_sqr = _mm512_fmadd_ps(dx, dx, _mm512_mul_ps(dy, dy));
+            lanes &= _mm512_cmp_ps_mask(distance_sqr, _mm512_setzero_ps(), _CMP_GT_OQ);
+            __m512 inv_r = _mm512_rsqrt14_ps(distance_sqr);
+            inv_r = _mm512_mul_ps(inv_r, _mm512_fnmadd_ps(_mm512_mul_ps(half, distance_sqr), _mm512_mul_ps(inv_r, inv_r), three_halves));
+            __m512 softened = _mm512_add_ps(distance_sqr, eps);
+            __m512 inv_softened = _mm512_rcp14_ps(softened);
+            inv_softened = _mm512_mul_ps(inv_softened, _mm512_fnmadd_ps(softened, inv_softened, two));
+            __m512 factor = _mm512_maskz_mul_ps(lanes, mass, _mm512_mul_ps(inv_r, inv_softened));
+            __m512d factor_low = _mm512_cvtps_pd(_mm512_castps512_ps256(factor));
+            __m512d factor_high = _mm512_cvtps_pd(_mm512_extractf32x8_ps(factor, 1));
+            ax = _mm512_fmadd_pd(factor_low, dx_low, _mm512_fmadd_pd(factor_high, dx_high, ax));
+            ay = _mm512_fmadd_pd(factor_low, dy_low, _mm512_fmadd_pd(factor_high, dy_high, ay));
+        }
+        accel_x[i] += _mm512_reduce_add_pd(ax);
+        accel_y[i] += _mm512_reduce_add_pd(ay);
+    }
+}
+
+
+// Higher moments. The potential of a node around its center of mass is
+// M ψ(r) + 1/2 Q:∇∇ψ(r) - 1/6 O:∇∇∇ψ(r), where ψ' = -1/(r² + ε) as in the kernels above.
+// With g(r²) = ψ(r), the derivatives of ψ reduce to g', g'', ... of u = r²:
+// g' = -1/2 u^(-1/2) (u + ε)^(-1), differentiated as a product.
+
+static void moments_scalar(const double* x, const double* y, int count, const moment_list* list, int order,
+        double epsilon, double* accel_x, double* accel_y)
+{
+    for (int i = 0; i < count; i++) {
+        double ax = 0;
+        double ay = 0;
+        for (int j = 0; j < list->count; j++) {
+            double rx = x[i] - list->x[j];
+            double ry = y[i] - list->y[j];
+            double u = rx*rx + ry*ry;
+            if (u == 0)
+                continue;
+            double inv_u = 1 / u;
+            double inv_r = sqrt(inv_u);
+            double inv_v = 1 / (u + epsilon);
+            double a1 = -0.5 * inv_r * inv_u;  // derivatives of u^(-1/2)
+            double a2 = 0.75 * inv_r * inv_u * inv_u;
+            double b1 = -inv_v * inv_v;  // derivatives of (u + ε)^(-1)
+            double b2 = 2 * inv_v * inv_v * inv_v;
+            double g2 = -0.5 * (a1 * inv_v + inv_r * b1);
+            double g3 = -0.5 * (a2 * inv_v + 2 * a1 * b1 + inv_r * b2);
+
+            // 1/2 Q:∇∇∇ψ
+            double qx = list->qxx[j] * rx + list->qxy[j] * ry;
+            double qy = list->qxy[j] * rx + list->qyy[j] * ry;
+            double rqr = rx * qx + ry * qy;
+            double trace = list->qxx[j] + list->qyy[j];
+            ax += 4 * g3 * rqr * rx + 2 * g2 * (trace * rx + 2 * qx);
+            ay += 4 * g3 * rqr * ry + 2 * g2 * (trace * ry + 2 * qy);
+            if (order < 3)
+                continue;
+
+            // -1/6 O:∇∇∇∇ψ
+            double a3 = -1.875 * inv_r * inv_u * inv_u * inv_u;
+            double b3 = -6 * inv_v * inv_v * inv_v * inv_v;
+            double g4 = -0.5 * (a3 * inv_v + 3 * a2 * b1 + 3 * a1 * b2 + inv_r * b3);
+            double orr_x = list->oxxx[j] * rx*rx + 2 * list->oxxy[j] * rx*ry + list->oxyy[j] * ry*ry;
+            double orr_y = list->oxxy[j] * rx*rx + 2 * list->oxyy[j] * rx*ry + list->oyyy[j] * ry*ry;
+            double orrr = orr_x * rx + orr_y * ry;
+            double trace_x = list->oxxx[j] + list->oxyy[j];
+            double trace_y = list->oxxy[j] + list->oyyy[j];
+            double trace_r = trace_x * rx + trace_y * ry;
+            ax -= (16 * g4 * orrr * rx + 24 * g3 * (orr_x + trace_r * rx) + 12 * g2 * trace_x) / 6;
+            ay -= (16 * g4 * orrr * ry + 24 * g3 * (orr_y + trace_r * ry) + 12 * g2 * trace_y) / 6;
+        }
+        accel_x[i] += ax;
+        accel_y[i] += ay;
+    }
+}
+
+__attribute__((target("avx2,fma")))
+static void moments_avx2(const double* x, const double* y, int count, const moment_list* list, int order,
+        double epsilon, double* accel_x, double* accel_y)
+{
+    const __m256d eps = _mm256_set1_pd(epsilon);
+    const __m256d zero = _mm256_setzero_pd();
+    const __m256d one = _mm256_set1_pd(1);
+    const __m256d minus_half = _mm256_set1_pd(-0.5);
+    const __m256d two = _mm256_set1_pd(2);
+    const __m256d three = _mm256_set1_pd(3);
+    const __m256d four = _mm256_set1_pd(4);
+    int vector_count = list->count & ~0x3;
+    for (int i = 0; i < count; i++) {
+        __m256d tx = _mm256_set1_pd(x[i]);
+        __m256d ty = _mm256_set1_pd(y[i]);
+        __m256d ax = zero;
+        __m256d ay = zero;
+        for (int j = 0; j < vector_count; j += 4) {
+            __m256d rx = _mm256_sub_pd(tx, _mm256_loadu_pd(&list->x[j]));
+            __m256d ry = _mm256_sub_pd(ty, _mm256_loadu_pd(&list->y[j]));
+            __m256d u = _mm256_fmadd_pd(rx, rx, _mm256_mul_pd(ry, ry));
+            __m256d valid = _mm256_cmp_pd(u, zero, _CMP_GT_OQ);
+            __m256d inv_u = _mm256_div_pd(one, u);
+            __m256d inv_r = _mm256_sqrt_pd(inv_u);
+            __m256d inv_v = _mm256_div_pd(one, _mm256_add_pd(u, eps));
+            __m256d a1 = _mm256_mul_pd(minus_half, _mm256_mul_pd(inv_r, inv_u));
+            __m256d a2 = _mm256_mul_pd(_mm256_set1_pd(-1.5), _mm256_mul_pd(a1, inv_u));
+            __m256d b1 = _mm256_sub_pd(zero, _mm256_mul_pd(inv_v, inv_v));
+            __m256d b2 = _mm256_mul_pd(_mm256_set1_pd(-2), _mm256_mul_pd(b1, inv_v));
+            __m256d g2 = _mm256_mul_pd(minus_half, _mm256_fmadd_pd(a1, inv_v, _mm256_mul_pd(inv_r, b1)));
+            __m256d g3 = _mm256_mul_pd(minus_half, _mm256_fmadd_pd(a2, inv_v,
+                    _mm256_fmadd_pd(_mm256_mul_pd(two, a1), b1, _mm256_mul_pd(inv_r, b2))));
+
+            __m256d qxx = _mm256_loadu_pd(&list->qxx[j]);
+            __m256d qxy = _mm256_loadu_pd(&list->qxy[j]);
+            __m256d qyy = _mm256_loadu_pd(&list->qyy[j]);
+            __m256d qx = _mm256_fmadd_pd(qxx, rx, _mm256_mul_pd(qxy, ry));
+            __m256d qy = _mm256_fmadd_pd(qxy, rx, _mm256_mul_pd(qyy, ry));
+            __m256d rqr = _mm256_fmadd_pd(rx, qx, _mm256_mul_pd(ry, qy));
+            __m256d trace = _mm256_add_pd(qxx, qyy);
+            __m256d radial = _mm256_mul_pd(four, _mm256_mul_pd(g3, rqr));
+            __m256d g2_twice = _mm256_mul_pd(two, g2);
+            __m256d fx = _mm256_fmadd_pd(radial, rx, _mm256_mul_pd(g2_twice, _mm256_fmadd_pd(trace, rx, _mm256_mul_pd(two, qx))));
+            __m256d fy = _mm256_fmadd_pd(radial, ry, _mm256_mul_pd(g2_twice, _mm256_fmadd_pd(trace, ry, _mm256_mul_pd(two, qy))));
+
+            if (order >= 3) {
+                __m256d a3 = _mm256_mul_pd(_mm256_set1_pd(-2.5), _mm256_mul_pd(a2, inv_u));
+                __m256d b3 = _mm256_mul_pd(_mm256_set1_pd(-3), _mm256_mul_pd(b2, inv_v));
+                __m256d g4 = _mm256_mul_pd(minus_half, _mm256_fmadd_pd(a3, inv_v, _mm256_fmadd_pd(_mm256_mul_pd(three, a2), b1,
+                        _mm256_fmadd_pd(_mm256_mul_pd(three, a1), b2, _mm256_mul_pd(inv_r, b3)))));
+                __m256d oxxx = _mm256_loadu_pd(&list->oxxx[j]);
+                __m256d oxxy = _mm256_loadu_pd(&list->oxxy[j]);
+                __m256d oxyy = _mm256_loadu_pd(&list->oxyy[j]);
+                __m256d oyyy = _mm256_loadu_pd(&list->oyyy[j]);
+                __m256d xx = _mm256_mul_pd(rx, rx);
+                __m256d xy2 = _mm256_mul_pd(two, _mm256_mul_pd(rx, ry));
+                __m256d yy = _mm256_mul_pd(ry, ry);
+                __m256d orr_x = _mm256_fmadd_pd(oxxx, xx, _mm256_fmadd_pd(oxxy, xy2, _mm256_mul_pd(oxyy, yy)));
+                __m256d orr_y = _mm256_fmadd_pd(oxxy, xx, _mm256_fmadd_pd(oxyy, xy2, _mm256_mul_pd(oyyy, yy)));
+                __m256d orrr = _mm256_fmadd_pd(orr_x, rx, _mm256_mul_pd(orr_y, ry));
+                __m256d trace_x = _mm256_add_pd(oxxx, oxyy);
+                __m256d trace_y = _mm256_add_pd(oxxy, oyyy);
+                __m256d trace_r = _mm256_fmadd_pd(trace_x, rx, _mm256_mul_pd(trace_y, ry));
+                __m256d c4 = _mm256_mul_pd(_mm256_set1_pd(16.0 / 6), _mm256_mul_pd(g4, orrr));
+                __m256d c3 = _mm256_mul_pd(four, g3);
+                fx = _mm256_sub_pd(fx, _mm256_fmadd_pd(c4, rx, _mm256_fmadd_pd(c3, _mm256_fmadd_pd(trace_r, rx, orr_x),
+                        _mm256_mul_pd(g2_twice, trace_x))));
+                fy = _mm256_sub_pd(fy, _mm256_fmadd_pd(c4, ry, _mm256_fmadd_pd(c3, _mm256_fmadd_pd(trace_r, ry, orr_y),
+                        _mm256_mul_pd(g2_twice, trace_y))));
+            }
+            ax = _mm256_add_pd(ax, _mm256_and_pd(fx, valid));
+            ay = _mm256_add_pd(ay, _mm256_and_pd(fy, valid));
+        }
+        double sum_x[4], sum_y[4];
+        _mm256_storeu_pd(sum_x, ax);
+        _mm256_storeu_pd(sum_y, ay);
+        double tail_x = 0;
+        double tail_y = 0;
+        moment_list tail = { &list->x[vector_count], &list->y[vector_count],
+                &list->qxx[vector_count], &list->qxy[vector_count], &list->qyy[vector_count],
+                &list->oxxx[vector_count], &list->oxxy[vector_count], &list->oxyy[vector_count], &list->oyyy[vector_count],
+                list->count - vector_count, 0 };
+        moments_scalar(&x[i], &y[i], 1, &tail, order, epsilon, &tail_x, &tail_y);
+        accel_x[i] += (sum_x[0] + sum_x[1]) + (sum_x[2] + sum_x[3]) + tail_x;
+        accel_y[i] += (sum_y[0] + sum_y[1]) + (sum_y[2] + sum_y[3]) + tail_y;
+    }
+}
+
+__attribute__((target("avx512f")))
+static void moments_avx512(const double* x, const double* y, int count, const moment_list* list, int order,
+        double epsilon, double* accel_x, double* accel_y)
+{
+    const __m512d eps = _mm512_set1_pd(epsilon);
+    const __m512d zero = _mm512_setzero_pd();
+    const __m512d one = _mm512_set1_pd(1);
+    const __m512d minus_half = _mm512_set1_pd(-0.5);
+    const __m512d two = _mm512_set1_pd(2);
+    const __m512d three = _mm512_set1_pd(3);
+    const __m512d four = _mm512_set1_pd(4);
+    for (int i = 0; i < count; i++) {
+        __m512d tx = _mm512_set1_pd(x[i]);
+        __m512d ty = _mm512_set1_pd(y[i]);
+        __m512d ax = zero;
+        __m512d ay = zero;
+        for (int j = 0; j < list->count; j += 8) {
+            __mmask8 lanes = list->count - j >= 8 ? 0xFF : (1 << (list->count - j)) - 1;
+            __m512d rx = _mm512_sub_pd(tx, _mm512_maskz_loadu_pd(lanes, &list->x[j]));
+            __m512d ry = _mm512_sub_pd(ty, _mm512_maskz_loadu_pd(lanes, &list->y[j]));
+            __m512d u = _mm512_fmadd_pd(rx, rx, _mm512_mul_pd(ry, ry));
+            lanes &= _mm512_cmp_pd_mask(u, zero, _CMP_GT_OQ);
+            __m512d inv_u = _mm512_div_pd(one, u);
+            __m512d inv_r = _mm512_sqrt_pd(inv_u);
+            __m512d inv_v = _mm512_div_pd(one, _mm512_add_pd(u, eps));
+            __m512d a1 = _mm512_mul_pd(minus_half, _mm512_mul_pd(inv_r, inv_u));
+            __m512d a2 = _mm512_mul_pd(_mm512_set1_pd(-1.5), _mm512_mul_pd(a1, inv_u));
+            __m512d b1 = _mm512_sub_pd(zero, _mm512_mul_pd(inv_v, inv_v));
+            __m512d b2 = _mm512_mul_pd(_mm512_set1_pd(-2), _mm512_mul_pd(b1, inv_v));
+            __m512d g2 = _mm512_mul_pd(minus_half, _mm512_fmadd_pd(a1, inv_v, _mm512_mul_pd(inv_r, b1)));
+            __m512d g3 = _mm512_mul_pd(minus_half, _mm512_fmadd_pd(a2, inv_v,
+                    _mm512_fmadd_pd(_mm512_mul_pd(two, a1), b1, _mm512_mul_pd(inv_r, b2))));
+
+            __m512d qxx = _mm512_maskz_loadu_pd(lanes, &list->qxx[j]);
+            __m512d qxy = _mm512_maskz_loadu_pd(lanes, &list->qxy[j]);
+            __m512d qyy = _mm512_maskz_loadu_pd(lanes, &list->qyy[j]);
+            __m512d qx = _mm512_fmadd_pd(qxx, rx, _mm512_mul_pd(qxy, ry));
+            __m512d qy = _mm512_fmadd_pd(qxy, rx, _mm512_mul_pd(qyy, ry));
+            __m512d rqr = _mm512_fmadd_pd(rx, qx, _mm512_mul_pd(ry, qy));
+            __m512d trace = _mm512_add_pd(qxx, qyy);
+            __m512d radial = _mm512_mul_pd(four, _mm512_mul_pd(g3, rqr));
+            __m512d g2_twice = _mm512_mul_pd(two, g2);
+            __m512d fx = _mm512_fmadd_pd(radial, rx, _mm512_mul_pd(g2_twice, _mm512_fmadd_pd(trace, rx, _mm512_mul_pd(two, qx))));
+            __m512d fy = _mm512_fmadd_pd(radial, ry, _mm512_mul_pd(g2_twice, _mm512_fmadd_pd(trace, ry, _mm512_mul_pd(two, qy))));
+
+            if (order >= 3) {
+                __m512d a3 = _mm512_mul_pd(_mm512_set1_pd(-2.5), _mm512_mul_pd(a2, inv_u));
+                __m512d b3 = _mm512_mul_pd(_mm512_set1_pd(-3), _mm512_mul_pd(b2, inv_v));
+                __m512d g4 = _mm512_mul_pd(minus_half, _mm512_fmadd_pd(a3, inv_v, _mm512_fmadd_pd(_mm512_mul_pd(three, a2), b1,
+                        _mm512_fmadd_pd(_mm512_mul_pd(three, a1), b2, _mm512_mul_pd(inv_r, b3)))));
+                __m512d oxxx = _mm512_maskz_loadu_pd(lanes, &list->oxxx[j]);
+                __m512d oxxy = _mm512_maskz_loadu_pd(lanes, &list->oxxy[j]);
+                __m512d oxyy = _mm512_maskz_loadu_pd(lanes, &list->oxyy[j]);
+                __m512d oyyy = _mm512_maskz_loadu_pd(lanes, &list->oyyy[j]);
+                __m512d xx = _mm512_mul_pd(rx, rx);
+                __m512d xy2 = _mm512_mul_pd(two, _mm512_mul_pd(rx, ry));
+                __m512d yy = _mm512_mul_pd(ry, ry);
+                __m512d orr_x = _mm512_fmadd_pd(oxxx, xx, _mm512_fmadd_pd(oxxy, xy2, _mm512_mul_pd(oxyy, yy)));
+                __m512d orr_y = _mm512_fmadd_pd(oxxy, xx, _mm512_fmadd_pd(oxyy, xy2, _mm512_mul_pd(oyyy, yy)));
+                __m512d orrr = _mm512_fmadd_pd(orr_x, rx, _mm512_mul_pd(orr_y, ry));
+                __m512d trace_x = _mm512_add_pd(oxxx, oxyy);
+                __m512d trace_y = _mm512_add_pd(oxxy, oyyy);
+                __m512d trace_r = _mm512_fmadd_pd(trace_x, rx, _mm512_mul_pd(trace_y, ry));
+                __m512d c4 = _mm512_mul_pd(_mm512_set1_pd(16.0 / 6), _mm512_mul_pd(g4, orrr));
+                __m512d c3 = _mm512_mul_pd(four, g3);
+                fx = _mm512_sub_pd(fx, _mm512_fmadd_pd(c4, rx, _mm512_fmadd_pd(c3, _mm512_fmadd_pd(trace_r, rx, orr_x),
+                        _mm512_mul_pd(g2_twice, trace_x))));
+                fy = _mm512_sub_pd(fy, _mm512_fmadd_pd(c4, ry, _mm512_fmadd_pd(c3, _mm512_fmadd_pd(trace_r, ry, orr_y),
+                        _mm512_mul_pd(g2_twice, trace_y))));
+            }
+            ax = _mm512_mask_add_pd(ax, lanes, ax, fx);
+            ay = _mm512_mask_add_pd(ay, lanes, ay, fy);
+        }
+        accel_x[i] += _mm512_reduce_add_pd(ax);
+        accel_y[i] += _mm512_reduce_add_pd(ay);
+    }
+}
+
+accel_kernel_t* accel_kernel = accel_scalar;
+moment_kernel_t* moment_kernel = moments_scalar;
+static std::string accel_kernel_name = "scalar";
+
+accel_kernel_t* find_kernel(const std::string& name, const std::string& precision)
+{
+    __builtin_cpu_init();
+    bool fast = (precision == "float");
+    if (name == "reference")
+        return accel_reference;
+    if (name == "scalar")
+        return fast ? accel_scalar_float : accel_scalar;
+    if (name == "avx2" && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return fast ? accel_avx2_float : accel_avx2;
+    if (name == "avx512" && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq"))
+        return fast ? accel_avx512_float : accel_avx512;
+    return NULL;
+}
+
+moment_kernel_t* find_moment_kernel(const std::string& name)
+{
+    __builtin_cpu_init();
+    if (name == "reference" || name == "scalar")
+        return moments_scalar;
+    if (name == "avx2" && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return moments_avx2;
+    if (name == "avx512" && __builtin_cpu_supports("avx512f"))
+        return moments_avx512;
+    return NULL;
+}
+
+void init_kernel()
+{
+    static const char* const preference[] = { "avx512", "avx2", "scalar" };
+    accel_kernel = NULL;
+    if (config.kernel != "auto") {
+        accel_kernel = find_kernel(config.kernel, config.precision);
+        accel_kernel_name = config.kernel;
+        if (!accel_kernel)
+            fprintf(stderr, "Kernel '%s' is not supported\n", config.kernel.c_str());
+    }
+    for (int i = 0; !accel_kernel; i++) {
+        accel_kernel = find_kernel(preference[i], config.precision);
+        accel_kernel_name = preference[i];
+    }
+    moment_kernel = find_moment_kernel(accel_kernel_name);
+}
+
+const char* kernel_name()
+{
+    return accel_kernel_name.c_str();
+}
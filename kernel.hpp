@@ -0,0 +1,83 @@
+#ifndef KERNEL_H
+#define KERNEL_H
+
+#include <string>
+
+// Sources of gravity acting on a group of stars, in SoA form
+struct interaction_list
+{
+    double* x;
+    double* y;
+    double* mass;
+    int count;
+    int capacity;
+};
+
+void grow_interaction_list(interaction_list* list);
+void free_interaction_list(interaction_list* list);
+
+static inline void push_interaction(interaction_list* list, double x, double y, double mass)
+{
+    if (list->count == list->capacity)
+        grow_interaction_list(list);
+    list->x[list->count] = x;
+    list->y[list->count] = y;
+    list->mass[list->count] = mass;
+    list->count++;
+}
+
+// Second and third moments of tree nodes, acting on a group of stars on top of their monopoles
+struct moment_list
+{
+    double* x;  // center of mass
+    double* y;
+    double* qxx;  // Σ m δi δj of the stars' offsets from the center of mass
+    double* qxy;
+    double* qyy;
+    double* oxxx;  // Σ m δi δj δk
+    double* oxxy;
+    double* oxyy;
+    double* oyyy;
+    int count;
+    int capacity;
+};
+
+void grow_moment_list(moment_list* list);
+void free_moment_list(moment_list* list);
+
+static inline void push_moments(moment_list* list, double x, double y, double qxx, double qxy, double qyy,
+        double oxxx, double oxxy, double oxyy, double oyyy)
+{
+    if (list->count == list->capacity)
+        grow_moment_list(list);
+    int i = list->count++;
+    list->x[i] = x;
+    list->y[i] = y;
+    list->qxx[i] = qxx;
+    list->qxy[i] = qxy;
+    list->qyy[i] = qyy;
+    list->oxxx[i] = oxxx;
+    list->oxxy[i] = oxxy;
+    list->oxyy[i] = oxyy;
+    list->oyyy[i] = oyyy;
+}
+
+// Add the attraction of every source in the list to each of the [count] targets,
+// not multiplied by the gravitational constant. Sources in the same point as the target are skipped.
+typedef void accel_kernel_t(const double* x, const double* y, int count, const interaction_list* list,
+        double epsilon, double* accel_x, double* accel_y);
+extern accel_kernel_t* accel_kernel;
+
+// Add the quadrupole (order 2) or also octupole (order 3) part of the nodes' attraction
+typedef void moment_kernel_t(const double* x, const double* y, int count, const moment_list* list, int order,
+        double epsilon, double* accel_x, double* accel_y);
+extern moment_kernel_t* moment_kernel;
+
+// Kernel by instruction set (reference, scalar, avx2, avx512) and precision (double, float);
+// NULL if the CPU does not support it
+accel_kernel_t* find_kernel(const std::string& name, const std::string& precision);
+moment_kernel_t* find_moment_kernel(const std::string& name);  // reference is the scalar one
+void init_kernel();  // choose the best kernel supported by the CPU, or the one in config.kernel
+const char* kernel_name();
+
+#endif // KERNEL_H
@@ -0,0 +1,135 @@
+// ****************************************************************************
+// LZ77 block compression for the trajectory output: greedy matching
+// through a hash table of 4-byte sequences, fast to compress and decompress.
+// ****************************************************************************
+
+#include "lz.hpp"
+
+#include <string.h>
+
+static const int hash_bits = 14;
+static const size_t min_match = 4;
+static const size_t max_offset = 65535;
+static const size_t tail = 12;  // bytes at the end that are always literals
+
+static inline uint32_t read32(const uint8_t* p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint32_t hash(uint32_t sequence)
+{
+    return (sequence * 2654435761u) >> (32 - hash_bits);
+}
+
+// Length over 15 in bytes of 255
+static inline uint8_t* write_length(uint8_t* dst, size_t length)
+{
+    for (; length >= 255; length -= 255)
+        *dst++ = 255;
+    *dst++ = (uint8_t)length;
+    return dst;
+}
+
+static inline uint8_t* write_sequence(uint8_t* dst, const uint8_t* literals, size_t literal_length,
+        size_t offset, size_t match_length)
+{
+    uint8_t* token = dst++;
+    *token = (uint8_t)((literal_length < 15 ? literal_length : 15) << 4);
+    if (literal_length >= 15)
+        dst = write_length(dst, literal_length - 15);
+    if (literal_length)
+        memcpy(dst, literals, literal_length);
+    dst += literal_length;
+    if (!match_length)
+        return dst;
+    *dst++ = (uint8_t)offset;
+    *dst++ = (uint8_t)(offset >> 8);
+    match_length -= min_match;
+    *token |= match_length < 15 ? match_length : 15;
+    if (match_length >= 15)
+        dst = write_length(dst, match_length - 15);
+    return dst;
+}
+
+size_t lz_bound(size_t size)
+{
+    return size + size / 255 + 16;
+}
+
+size_t lz_compress(const uint8_t* src, size_t size, uint8_t* dst)
+{
+    static thread_local size_t table[1 << hash_bits];  // last position + 1 of each hashed sequence
+    memset(table, 0, sizeof(table));
+    uint8_t* out = dst;
+    size_t anchor = 0;
+    for (size_t i = 0; i + tail < size; ) {
+        uint32_t sequence = read32(src + i);
+        size_t* entry = &table[hash(sequence)];
+        size_t candidate = *entry;
+        *entry = i + 1;
+        if (!candidate || i - (candidate - 1) > max_offset || read32(src + candidate - 1) != sequence) {
+            i++;
+            continue;
+        }
+        size_t match = candidate - 1;
+        size_t length = min_match;
+        while (i + length + tail < size && src[match + length] == src[i + length])
+            length++;
+        out = write_sequence(out, src + anchor, i - anchor, i - match, length);
+        i += length;
+        anchor = i;
+    }
+    out = write_sequence(out, src + anchor, size - anchor, 0, 0);
+    return out - dst;
+}
+
+bool lz_decompress(const uint8_t* src, size_t packed_size, uint8_t* dst, size_t size)
+{
+    const uint8_t* in = src;
+    const uint8_t* in_end = src + packed_size;
+    size_t out = 0;
+    while (in < in_end) {
+        uint8_t token = *in++;
+        size_t literal_length = token >> 4;
+        if (literal_length == 15) {
+            uint8_t byte;
+            do {
+                if (in == in_end)
+                    return false;
+                byte = *in++;
+                literal_length += byte;
+            } while (byte == 255);
+        }
+        if (literal_length > (size_t)(in_end - in) || literal_length > size - out)
+            return false;
+        if (literal_length)
+            memcpy(dst + out, in, literal_length);
+        in += literal_length;
+        out += literal_length;
+        if (in == in_end)
+            break;  // the last sequence
+
+        if (in_end - in < 2)
+            return false;
+        size_t offset = in[0] | in[1] << 8;
+        in += 2;
+        size_t match_length = (token & 0xF) + min_match;
+        if ((token & 0xF) == 15) {
+            uint8_t byte;
+            do {
+                if (in == in_end)
+                    return false;
+                byte = *in++;
+                match_length += byte;
+            } while (byte == 255);
+        }
+        if (!offset || offset > out || match_length > size - out)
+            return false;
+        for (size_t i = 0; i < match_length; i++, out++)  // may overlap itself
+            dst[out] = dst[out - offset];
+    }
+    return out == size;
+}
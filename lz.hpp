@@ -0,0 +1,19 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Small LZ77 block compressor in the spirit of LZ4: sequences of a token (literal length << 4 | match length - 4),
+// the literals, and a 16-bit match offset; lengths of 15 continue in bytes of 255. The last sequence has no match.
+
+// Largest compressed size of [size] bytes
+size_t lz_bound(size_t size);
+
+// Returns the compressed size; [dst] must hold lz_bound(size) bytes
+size_t lz_compress(const uint8_t* src, size_t size, uint8_t* dst);
+
+// Returns false if [src] is not a valid block of exactly [size] bytes
+bool lz_decompress(const uint8_t* src, size_t packed_size, uint8_t* dst, size_t size);
+
+#endif // LZ_H
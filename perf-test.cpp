@@ -0,0 +1,43 @@
+// ****************************************************************************
+// Checks of PerfCounter over a partly filled, a full and a wrapped ring.
+// ****************************************************************************
+
+#include <stdio.h>
+
+#include "common.hpp"
+
+static int failures = 0;
+
+static void check(const char* what, float value, float expected)
+{
+    if (value != expected) {
+        fprintf(stderr, "%s: %g, expected %g\n", what, value, expected);
+        failures++;
+    }
+}
+
+int main()
+{
+    PerfCounter counter;
+    for (int i = 1; i <= 100; i++)
+        counter.add(i);
+    check("mean of a partly filled ring", counter.mean(100), 50.5f);
+    check("max of a partly filled ring", counter.max(100), 100);
+
+    for (int i = 101; i <= 256; i++)
+        counter.add(i);
+    check("mean of a full ring", counter.mean(256), 128.5f);
+    check("mean over more frames than the ring holds", counter.mean(1000), 128.5f);
+    check("max of a full ring", counter.max(256), 256);
+
+    counter.add(1000);
+    counter.add(0);
+    check("mean of a wrapped ring", counter.mean(256), (256*257/2.0f - 1 - 2 + 1000) / 256);
+    check("max of a wrapped ring", counter.max(256), 1000);
+    check("mean of the last frames", counter.mean(2), 500);
+    check("last value", counter.last(), 0);
+
+    if (failures == 0)
+        printf("PerfCounter: all checks passed\n");
+    return failures != 0;
+}
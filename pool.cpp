@@ -0,0 +1,175 @@
+// ****************************************************************************
+// Thread pool with spin-then-park workers and optional NUMA-aware pinning.
+// ****************************************************************************
+
+#include "pool.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <immintrin.h>
+
+static const int min_spin = 1 << 6;  // iterations of busy waiting before parking
+static const int max_spin = 1 << 14;
+
+static inline void cpu_relax()
+{
+    _mm_pause();
+}
+
+// CPUs allowed for the process, ordered by NUMA node: compact puts the CPUs of a node together,
+// scatter alternates between nodes
+static std::vector<int> cpu_order(bool scatter)
+{
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+
+    // Linux exposes node CPU lists like "0-7,16-23"
+    std::vector<std::vector<int>> nodes;
+    for (int node = 0; ; node++) {
+        std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+        if (!file)
+            break;
+        std::vector<int> cpus;
+        std::string range;
+        while (std::getline(file, range, ',')) {
+            int first = 0, last = -1;
+            char dash = 0;
+            std::istringstream(range) >> first >> dash >> last;
+            if (dash != '-')
+                last = first;
+            for (int cpu = first; cpu <= last; cpu++)
+                if (CPU_ISSET(cpu, &allowed))
+                    cpus.push_back(cpu);
+        }
+        if (!cpus.empty())
+            nodes.push_back(cpus);
+    }
+    if (nodes.empty()) {  // no NUMA information
+        nodes.emplace_back();
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            if (CPU_ISSET(cpu, &allowed))
+                nodes[0].push_back(cpu);
+    }
+
+    std::vector<int> order;
+    if (!scatter) {
+        for (const auto& node : nodes)
+            order.insert(order.end(), node.begin(), node.end());
+        return order;
+    }
+    for (size_t i = 0; ; i++) {
+        size_t size = order.size();
+        for (const auto& node : nodes)
+            if (i < node.size())
+                order.push_back(node[i]);
+        if (order.size() == size)
+            return order;
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    stop();
+}
+
+void ThreadPool::start(int threads, const std::string& affinity)
+{
+    stop();
+    this->threads = threads > 1 ? threads : 1;
+    // Oversubscribed threads would spin in the time slices of those doing the work
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    spin_limit = this->threads <= CPU_COUNT(&allowed) ? max_spin : 0;
+    spin = std::min(min_spin, spin_limit);
+    std::vector<int> cpus;
+    if (affinity == "compact" || affinity == "scatter")
+        cpus = cpu_order(affinity == "scatter");
+    else if (affinity != "none" && !affinity.empty())
+        fprintf(stderr, "Unknown affinity '%s'\n", affinity.c_str());
+
+    for (int i = 1; i < this->threads; i++) {
+        // The generation is read here, as a late worker would otherwise miss the first job
+        uint32_t seen = generation.load();
+        workers.emplace_back([this, i, seen](std::stop_token stop) { worker(stop, i, seen); });
+        if (!cpus.empty()) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpus[i % cpus.size()], &set);
+            pthread_setaffinity_np(workers.back().native_handle(), sizeof(set), &set);
+        }
+    }
+}
+
+void ThreadPool::stop()
+{
+    for (auto& worker : workers)
+        worker.request_stop();
+    wake();
+    workers.clear();  // joins
+    threads = 1;
+}
+
+void ThreadPool::wake()
+{
+    // Sequentially consistent, paired with parking in worker(), so a wake-up is never lost
+    generation.fetch_add(1);
+    if (parked.load())
+        generation.notify_all();
+}
+
+void ThreadPool::run(void (*function)(int thread))
+{
+    if (workers.empty()) {
+        function(0);
+        return;
+    }
+    job = function;
+    pending.store(workers.size(), std::memory_order_relaxed);
+    wake();
+    function(0);
+
+    int i = 0;
+    while (pending.load(std::memory_order_acquire) && i < spin) {
+        cpu_relax();
+        i++;
+    }
+    spin = i < spin ? std::min(spin * 2, spin_limit) : std::min(std::max(spin / 2, min_spin), spin_limit);
+    for (int left; (left = pending.load(std::memory_order_acquire)); )
+        pending.wait(left, std::memory_order_acquire);
+}
+
+void ThreadPool::worker(std::stop_token stop, int thread, uint32_t seen)
+{
+    int spin = std::min(min_spin, spin_limit);
+    while (true) {
+        // Spin, then park until the next job or stop request
+        int i = 0;
+        while (generation.load(std::memory_order_acquire) == seen && i < spin) {
+            cpu_relax();
+            i++;
+        }
+        if (i < spin) {
+            spin = std::min(spin * 2, spin_limit);  // the job came soon, spin longer next time
+        } else {
+            spin = std::min(std::max(spin / 2, min_spin), spin_limit);
+            parked.fetch_add(1);
+            while (generation.load() == seen)
+                generation.wait(seen, std::memory_order_acquire);
+            parked.fetch_sub(1, std::memory_order_relaxed);
+        }
+        seen = generation.load(std::memory_order_acquire);
+        if (stop.stop_requested())
+            return;
+
+        job(thread);
+        if (pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            pending.notify_one();
+    }
+}
@@ -0,0 +1,38 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Fork-join thread pool: run() calls the function in every thread, including the calling one
+// as thread #0, and returns when all of them are done. Idle workers spin for a while before
+// parking on an atomic wait, and the spin time adapts to how soon the next job usually comes.
+class ThreadPool
+{
+private:
+    void worker(std::stop_token stop, int thread, uint32_t seen);
+    void wake();
+
+    std::vector<std::jthread> workers;
+    void (*job)(int thread) = nullptr;
+    std::atomic<uint32_t> generation = 0;  // incremented for every job
+    std::atomic<int> pending = 0;  // workers still running the current job
+    std::atomic<int> parked = 0;  // workers sleeping in generation.wait()
+    int threads = 1;
+    int spin = 0;  // adaptive spin time of the calling thread
+    int spin_limit = 0;  // no spinning when there are more threads than CPUs
+
+public:
+    ~ThreadPool();
+
+    // [affinity]: none, compact (fill NUMA nodes one by one), or scatter (round robin over nodes);
+    // the calling thread is never pinned
+    void start(int threads, const std::string& affinity);
+    void stop();
+    void run(void (*function)(int thread));
+    int size() const { return threads; }
+};
+
+#endif // POOL_H
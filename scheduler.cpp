@@ -0,0 +1,76 @@
+#include "scheduler.hpp"
+
+WorkQueue::~WorkQueue()
+{
+    delete[] ranges;
+}
+
+void WorkQueue::init(int threads)
+{
+    delete[] ranges;
+    this->threads = threads;
+    ranges = new Range[threads];
+    for (int i = 0; i < threads; i++)
+        ranges[i].range.store(0, std::memory_order_relaxed);
+}
+
+// Without stealing, every thread just gets its contiguous part
+void WorkQueue::reset(int count, int chunk, bool stealing)
+{
+    this->chunk = chunk > 0 ? chunk : 1;
+    this->stealing = stealing;
+    for (int i = 0; i < threads; i++) {
+        uint32_t begin = (int64_t)count * i / threads;
+        uint32_t end = (int64_t)count * (i + 1) / threads;
+        ranges[i].range.store(pack(begin, end), std::memory_order_relaxed);
+    }
+}
+
+bool WorkQueue::next(int thread, int* begin, int* end)
+{
+    std::atomic<uint64_t>& own = ranges[thread].range;
+    do {
+        uint64_t range = own.load(std::memory_order_acquire);
+        while ((uint32_t)range < (uint32_t)(range >> 32)) {
+            uint32_t range_begin = (uint32_t)range;
+            uint32_t range_end = (uint32_t)(range >> 32);
+            uint32_t chunk_end = range_end - range_begin > (uint32_t)chunk ? range_begin + chunk : range_end;
+            if (own.compare_exchange_weak(range, pack(chunk_end, range_end), std::memory_order_acq_rel)) {
+                *begin = range_begin;
+                *end = chunk_end;
+                return true;
+            }
+        }
+    } while (stealing && steal(thread));
+    return false;
+}
+
+// Move the back half of the largest part to the thread; false if all parts are empty
+bool WorkQueue::steal(int thread)
+{
+    while (true) {
+        int victim = -1;
+        uint32_t largest = 0;
+        for (int i = 0; i < threads; i++) {
+            uint64_t range = ranges[i].range.load(std::memory_order_relaxed);
+            uint32_t size = (uint32_t)(range >> 32) - (uint32_t)range;
+            if (size > largest) {
+                largest = size;
+                victim = i;
+            }
+        }
+        if (victim < 0)
+            return false;
+
+        uint64_t range = ranges[victim].range.load(std::memory_order_acquire);
+        uint32_t range_begin = (uint32_t)range;
+        uint32_t range_end = (uint32_t)(range >> 32);
+        if (range_begin >= range_end)
+            continue;
+        uint32_t middle = range_begin + (range_end - range_begin) / 2;  // a single item goes to the thief
+        if (ranges[victim].range.compare_exchange_strong(range, pack(range_begin, middle), std::memory_order_acq_rel)) {
+            ranges[thread].range.store(pack(middle, range_end), std::memory_order_release);
+            return true;
+        }
+    }
+}
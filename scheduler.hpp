@@ -0,0 +1,34 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <atomic>
+#include <stdint.h>
+
+// Work-stealing distribution of [0, count) among threads. Every thread starts with
+// a contiguous part and takes chunks from its front; a thread that runs out steals
+// the back half of the largest remaining part, so all work stays in contiguous runs.
+class WorkQueue
+{
+private:
+    // [begin, end) packed as begin | end << 32, on its own cache line
+    struct alignas(64) Range
+    {
+        std::atomic<uint64_t> range;
+    };
+
+    static uint64_t pack(uint32_t begin, uint32_t end) { return begin | (uint64_t)end << 32; }
+    bool steal(int thread);
+
+    Range* ranges = nullptr;
+    int threads = 0;
+    int chunk = 1;
+    bool stealing = true;
+
+public:
+    ~WorkQueue();
+    void init(int threads);
+    void reset(int count, int chunk, bool stealing = true);  // called before the job starts
+    bool next(int thread, int* begin, int* end);  // false when there is no work left
+};
+
+#endif // SCHEDULER_H
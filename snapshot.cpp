@@ -0,0 +1,127 @@
+// ****************************************************************************
+// Binary snapshots of the simulation state: written on a background thread
+// from a copy of the columns, and read back through a read-only file mapping.
+// ****************************************************************************
+
+#include "snapshot.hpp"
+
+#include <thread>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char snapshot_magic[8] = "CONSTEL";
+static const uint32_t snapshot_version = 1;
+
+static snapshot pending = { 0 };  // being filled or written
+static std::jthread writer;
+
+// Point the columns into [data]; returns the file size
+static size_t layout(snapshot* snap, char* data, int64_t stars)
+{
+    size_t offset = (sizeof(snapshot_header) + 63) & ~(size_t)63;
+    auto column = [&](size_t element_size) {
+        char* column = data ? data + offset : NULL;
+        offset += (element_size * stars + 63) & ~(size_t)63;
+        return column;
+    };
+    snap->header = (snapshot_header*)data;
+    snap->x = (double*)column(sizeof(double));
+    snap->y = (double*)column(sizeof(double));
+    snap->speed_x = (double*)column(sizeof(double));
+    snap->speed_y = (double*)column(sizeof(double));
+    snap->accel_x = (double*)column(sizeof(double));
+    snap->accel_y = (double*)column(sizeof(double));
+    snap->mass = (double*)column(sizeof(double));
+    snap->step = (double*)column(sizeof(double));
+    snap->level = (int32_t*)column(sizeof(int32_t));
+    snap->color = (float*)column(3 * sizeof(float));
+    snap->data = data;
+    snap->size = offset;
+    return offset;
+}
+
+snapshot* begin_snapshot(int64_t stars)
+{
+    finish_snapshot();
+    size_t size = layout(&pending, NULL, stars);
+    layout(&pending, (char*)calloc(size, 1), stars);
+    memcpy(pending.header->magic, snapshot_magic, sizeof(snapshot_magic));
+    pending.header->version = snapshot_version;
+    pending.header->header_size = sizeof(snapshot_header);
+    pending.header->stars = stars;
+    return &pending;
+}
+
+static void write_job(std::string filename)
+{
+    std::string temp = filename + ".tmp";
+    FILE* file = fopen(temp.c_str(), "wb");
+    bool done = file && fwrite(pending.data, pending.size, 1, file) == 1;
+    if (file && fclose(file))
+        done = false;
+    if (done && rename(temp.c_str(), filename.c_str()))
+        done = false;
+    if (!done) {
+        fprintf(stderr, "Cannot write snapshot '%s'\n", filename.c_str());
+        remove(temp.c_str());
+    }
+    free(pending.data);
+    memset(&pending, 0, sizeof(pending));
+}
+
+void write_snapshot(const std::string& filename)
+{
+    writer = std::jthread(write_job, filename);
+}
+
+void finish_snapshot()
+{
+    if (writer.joinable())
+        writer.join();
+}
+
+bool map_snapshot(const std::string& filename, snapshot* result)
+{
+    memset(result, 0, sizeof(*result));
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot open snapshot '%s'\n", filename.c_str());
+        return false;
+    }
+    struct stat status;
+    void* data = MAP_FAILED;
+    if (!fstat(fd, &status) && status.st_size >= (off_t)sizeof(snapshot_header))
+        data = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Cannot map snapshot '%s'\n", filename.c_str());
+        return false;
+    }
+
+    const snapshot_header* header = (const snapshot_header*)data;
+    if (memcmp(header->magic, snapshot_magic, sizeof(snapshot_magic)) || header->version != snapshot_version
+            || header->header_size != sizeof(snapshot_header) || header->stars < 2 || header->stars >= 1 << 28
+            || layout(result, NULL, header->stars) > (size_t)status.st_size) {
+        fprintf(stderr, "'%s' is not a version %u snapshot\n", filename.c_str(), snapshot_version);
+        munmap(data, status.st_size);
+        memset(result, 0, sizeof(*result));
+        return false;
+    }
+    layout(result, (char*)data, header->stars);
+    result->size = status.st_size;
+    madvise(data, result->size, MADV_SEQUENTIAL);
+    return true;
+}
+
+void unmap_snapshot(snapshot* snap)
+{
+    if (snap->data)
+        munmap(snap->data, snap->size);
+    memset(snap, 0, sizeof(*snap));
+}
@@ -0,0 +1,53 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <string>
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Snapshot file, in the machine's byte order: a header, then one column per field in the order of
+// star ids, each column starting at a 64-byte boundary
+struct snapshot_header
+{
+    char magic[8];  // "CONSTEL\0"
+    uint32_t version;
+    uint32_t header_size;
+    int64_t stars;
+    int64_t frame;  // frames simulated before the snapshot
+    double time;  // simulated time
+    double frame_time;  // of the last frame; the accelerations are multiplied by its half
+};
+
+// The columns of a snapshot being written or a mapped one
+struct snapshot
+{
+    snapshot_header* header;
+    double* x;
+    double* y;
+    double* speed_x;
+    double* speed_y;
+    double* accel_x;
+    double* accel_y;
+    double* mass;
+    double* step;  // individual time steps, zero without them
+    int32_t* level;
+    float* color;  // red, green and blue
+    void* data;  // the file mapping or the write buffer
+    size_t size;
+};
+
+// Columns of a new snapshot to fill; waits for the previous write to finish
+snapshot* begin_snapshot(int64_t stars);
+
+// Write the filled snapshot on a background thread, replacing the file once it is complete
+void write_snapshot(const std::string& filename);
+
+// Wait for the background write
+void finish_snapshot();
+
+// Map a snapshot file read-only; false with an error message if it cannot be used
+bool map_snapshot(const std::string& filename, snapshot* result);
+void unmap_snapshot(snapshot* snap);
+
+#endif // SNAPSHOT_H
@@ -0,0 +1,390 @@
+// ****************************************************************************
+// Streaming trajectory output: the simulation thread quantises the positions
+// into a small ring of buffers, and an I/O thread delta-encodes, compresses
+// and writes them, so a slow disk drops frames instead of stalling the world.
+// Recorded files are read back through a read-only mapping for replays.
+// ****************************************************************************
+
+#include "trajectory.hpp"
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "lz.hpp"
+
+#ifdef CONSTEL_ZSTD
+#include <zstd.h>
+#endif
+
+static const char trajectory_magic[8] = "CONTRAJ";
+static const uint32_t trajectory_version = 2;
+static const int queue_slots = 4;
+static const int key_interval = 64;
+
+static FILE* file = nullptr;
+static std::string file_name;
+static trajectory_header header;
+static uint32_t codec;
+static int64_t* slots[queue_slots] = { nullptr };  // quantised frames
+static int64_t slot_frames[queue_slots];
+static double slot_times[queue_slots];
+static int queue_head;  // oldest queued slot, being written
+static int queued;  // number of queued slots
+static int64_t dropped;  // frames skipped because the queue was full
+static int64_t* previous = nullptr;  // the last two written frames
+static std::vector<uint8_t> raw;
+static std::vector<uint8_t> packed;
+static std::vector<int64_t> offsets;  // of the chunks
+static int64_t file_offset;
+static bool failed;
+static std::mutex mutex;
+static std::condition_variable_any frame_queued;
+static std::jthread writer;
+
+static inline uint8_t* write_varint(uint8_t* out, uint64_t value)
+{
+    while (value >= 0x80) {
+        *out++ = (uint8_t)value | 0x80;
+        value >>= 7;
+    }
+    *out++ = (uint8_t)value;
+    return out;
+}
+
+static void write_data(const void* data, size_t size)
+{
+    if (!failed && fwrite(data, size, 1, file) != 1) {
+        fprintf(stderr, "Cannot write trajectory '%s'\n", file_name.c_str());
+        failed = true;
+    }
+    file_offset += size;
+}
+
+// Encode, compress and write one queued frame
+static void write_frame(const int64_t* positions, int64_t frame, double time)
+{
+    size_t count = 2 * header.stars;
+    int since_key = header.frames % key_interval;
+    const int64_t* last = previous;
+    const int64_t* before_last = previous + count;
+    uint8_t* out = raw.data();
+    for (size_t i = 0; i < count; i++) {
+        int64_t prediction = since_key == 0 ? 0 : since_key == 1 ? last[i] : 2*last[i] - before_last[i];
+        int64_t delta = positions[i] - prediction;
+        out = write_varint(out, (uint64_t)delta << 1 ^ (uint64_t)(delta >> 63));  // zigzag
+    }
+    memcpy(previous + count, previous, count * sizeof(int64_t));
+    memcpy(previous, positions, count * sizeof(int64_t));
+    bool key = since_key == 0;
+
+    trajectory_chunk chunk = { frame, time, codec, key, (uint64_t)(out - raw.data()), 0 };
+    if (codec == codec_lz)
+        chunk.packed_size = lz_compress(raw.data(), chunk.raw_size, packed.data());
+    #ifdef CONSTEL_ZSTD
+    if (codec == codec_zstd) {
+        chunk.packed_size = ZSTD_compress(packed.data(), packed.size(), raw.data(), chunk.raw_size, 3);
+        if (ZSTD_isError(chunk.packed_size))
+            chunk.packed_size = chunk.raw_size;
+    }
+    #endif
+    const uint8_t* data = packed.data();
+    if (codec == codec_none || chunk.packed_size >= chunk.raw_size) {  // incompressible
+        chunk.codec = codec_none;
+        chunk.packed_size = chunk.raw_size;
+        data = raw.data();
+    }
+    offsets.push_back(file_offset);
+    write_data(&chunk, sizeof(chunk));
+    write_data(data, chunk.packed_size);
+    header.frames++;
+}
+
+static void writer_loop(std::stop_token stop)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        frame_queued.wait(lock, stop, [] { return queued > 0; });
+        if (!queued)
+            return;  // stopped with nothing left to write
+        int slot = queue_head;
+        lock.unlock();
+        write_frame(slots[slot], slot_frames[slot], slot_times[slot]);
+        lock.lock();
+        queue_head = (queue_head + 1) % queue_slots;
+        queued--;
+    }
+}
+
+bool open_trajectory(const std::string& filename, int64_t stars, const float* color, double quantum, int every,
+        const std::string& codec_name)
+{
+    if (codec_name == "none") {
+        codec = codec_none;
+    } else if (codec_name == "lz") {
+        codec = codec_lz;
+    #ifdef CONSTEL_ZSTD
+    } else if (codec_name == "zstd") {
+        codec = codec_zstd;
+    #endif
+    } else {
+        fprintf(stderr, "Unknown or unavailable trajectory compression '%s'\n", codec_name.c_str());
+        return false;
+    }
+    file = fopen(filename.c_str(), "wb");
+    if (!file) {
+        fprintf(stderr, "Cannot open trajectory '%s'\n", filename.c_str());
+        return false;
+    }
+    file_name = filename;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, trajectory_magic, sizeof(trajectory_magic));
+    header.version = trajectory_version;
+    header.header_size = sizeof(header);
+    header.stars = stars;
+    header.quantum = quantum;
+    header.every = every;
+    header.key_interval = key_interval;
+    header.color_offset = sizeof(header);
+    file_offset = 0;
+    failed = false;
+    write_data(&header, sizeof(header));
+    write_data(color, 3 * stars * sizeof(float));
+
+    size_t raw_size = 2 * stars * 10;  // the longest varints
+    raw.resize(raw_size);
+    packed.resize(lz_bound(raw_size));
+    #ifdef CONSTEL_ZSTD
+    if (codec == codec_zstd)
+        packed.resize(ZSTD_compressBound(raw_size));
+    #endif
+    offsets.clear();
+    for (int i = 0; i < queue_slots; i++)
+        slots[i] = (int64_t*)malloc(2 * stars * sizeof(int64_t));
+    previous = (int64_t*)malloc(2 * 2 * stars * sizeof(int64_t));
+    queue_head = 0;
+    queued = 0;
+    dropped = 0;
+    writer = std::jthread(writer_loop);
+    return true;
+}
+
+int64_t* trajectory_frame()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (queued == queue_slots) {
+        dropped++;
+        return nullptr;
+    }
+    return slots[(queue_head + queued) % queue_slots];
+}
+
+void push_trajectory_frame(int64_t frame, double time)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        int slot = (queue_head + queued) % queue_slots;
+        slot_frames[slot] = frame;
+        slot_times[slot] = time;
+        queued++;
+    }
+    frame_queued.notify_one();
+}
+
+void close_trajectory()
+{
+    if (!file)
+        return;
+    writer.request_stop();
+    writer.join();
+    header.index_offset = file_offset;
+    write_data(offsets.data(), offsets.size() * sizeof(int64_t));
+    if (!failed && (fseek(file, 0, SEEK_SET) || fwrite(&header, sizeof(header), 1, file) != 1))
+        fprintf(stderr, "Cannot write trajectory '%s'\n", file_name.c_str());
+    fclose(file);
+    file = nullptr;
+    if (dropped)
+        fprintf(stderr, "Trajectory '%s': %ld frames dropped, the disk could not keep up\n", file_name.c_str(), (long)dropped);
+    for (int i = 0; i < queue_slots; i++) {
+        free(slots[i]);
+        slots[i] = nullptr;
+    }
+    free(previous);
+    previous = nullptr;
+    raw = std::vector<uint8_t>();
+    packed = std::vector<uint8_t>();
+}
+
+// Offset of the first chunk, after the colours
+static inline int64_t chunks_offset(const trajectory_header* header)
+{
+    return header->color_offset + 3 * header->stars * sizeof(float);
+}
+
+// Add the chunk at [offset] if it and its data lie within the file
+static bool add_chunk(trajectory_reader* reader, int64_t offset)
+{
+    if (offset < chunks_offset(reader->header) || offset > (int64_t)(reader->size - sizeof(trajectory_chunk)))
+        return false;
+    trajectory_chunk chunk;
+    memcpy(&chunk, (const char*)reader->data + offset, sizeof(chunk));
+    if (chunk.packed_size > reader->size - offset - sizeof(chunk) || chunk.raw_size > reader->raw.size())
+        return false;
+    reader->chunks.push_back(chunk);
+    reader->chunk_data.push_back((const uint8_t*)reader->data + offset + sizeof(chunk));
+    return true;
+}
+
+bool map_trajectory(const std::string& filename, trajectory_reader* result)
+{
+    unmap_trajectory(result);
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot open trajectory '%s'\n", filename.c_str());
+        return false;
+    }
+    struct stat status;
+    void* data = MAP_FAILED;
+    if (!fstat(fd, &status) && status.st_size >= (off_t)sizeof(trajectory_header))
+        data = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Cannot map trajectory '%s'\n", filename.c_str());
+        return false;
+    }
+    result->data = data;
+    result->size = status.st_size;
+    result->header = (const trajectory_header*)data;
+
+    const trajectory_header* header = result->header;
+    if (memcmp(header->magic, trajectory_magic, sizeof(trajectory_magic)) || header->version != trajectory_version
+            || header->header_size != sizeof(trajectory_header) || header->stars < 2 || header->stars >= 1 << 28
+            || !(header->quantum > 0) || header->key_interval <= 0 || header->color_offset != header->header_size
+            || (uint64_t)chunks_offset(header) > result->size) {
+        fprintf(stderr, "'%s' is not a version %u trajectory\n", filename.c_str(), trajectory_version);
+        unmap_trajectory(result);
+        return false;
+    }
+    result->color.resize(3 * header->stars);
+    memcpy(result->color.data(), (const char*)data + header->color_offset, result->color.size() * sizeof(float));
+    result->raw.resize(2 * header->stars * 10);  // the longest varints
+    bool indexed = header->index_offset >= chunks_offset(header) && header->frames >= 0
+            && (uint64_t)header->frames <= (result->size - header->index_offset) / sizeof(int64_t);
+    for (int64_t frame = 0; indexed && frame < header->frames; frame++) {
+        int64_t offset;
+        memcpy(&offset, (const char*)data + header->index_offset + frame * sizeof(int64_t), sizeof(offset));
+        indexed = add_chunk(result, offset);
+    }
+    if (!indexed) {  // the recording was interrupted
+        result->chunks.clear();
+        result->chunk_data.clear();
+        for (int64_t offset = chunks_offset(header); add_chunk(result, offset); )
+            offset += sizeof(trajectory_chunk) + result->chunks.back().packed_size;
+        fprintf(stderr, "Trajectory '%s' was not closed, %zu frames found\n", filename.c_str(), result->chunks.size());
+    }
+    if (result->chunks.empty()) {
+        fprintf(stderr, "Trajectory '%s' has no frames\n", filename.c_str());
+        unmap_trajectory(result);
+        return false;
+    }
+    madvise(data, result->size, MADV_SEQUENTIAL);
+    result->frames.resize(3 * 2 * header->stars);
+    result->positions = result->frames.data();
+    result->last = result->positions + 2 * header->stars;
+    result->before_last = result->last + 2 * header->stars;
+    result->decoded = -1;
+    return true;
+}
+
+void unmap_trajectory(trajectory_reader* reader)
+{
+    if (reader->data)
+        munmap(reader->data, reader->size);
+    reader->header = nullptr;
+    reader->color = std::vector<float>();
+    reader->chunks.clear();
+    reader->chunk_data.clear();
+    reader->decoded = -1;
+    reader->positions = reader->last = reader->before_last = nullptr;
+    reader->frames = std::vector<int64_t>();
+    reader->raw = std::vector<uint8_t>();
+    reader->data = nullptr;
+    reader->size = 0;
+}
+
+// Decode the frame after the decoded one, which becomes the last
+static bool decode_next(trajectory_reader* reader)
+{
+    int64_t frame = reader->decoded + 1;
+    const trajectory_chunk& chunk = reader->chunks[frame];
+    const uint8_t* packed = reader->chunk_data[frame];
+    int since_key = frame % reader->header->key_interval;
+    if (chunk.key != (since_key == 0))
+        return false;
+    const uint8_t* in = packed;
+    if (chunk.codec == codec_lz) {
+        if (!lz_decompress(packed, chunk.packed_size, reader->raw.data(), chunk.raw_size))
+            return false;
+        in = reader->raw.data();
+    #ifdef CONSTEL_ZSTD
+    } else if (chunk.codec == codec_zstd) {
+        if (ZSTD_decompress(reader->raw.data(), reader->raw.size(), packed, chunk.packed_size) != chunk.raw_size)
+            return false;
+        in = reader->raw.data();
+    #endif
+    } else if (chunk.codec != codec_none || chunk.packed_size != chunk.raw_size) {
+        return false;
+    }
+    const uint8_t* in_end = in + chunk.raw_size;
+
+    int64_t* positions = reader->before_last;  // reused for the new frame
+    reader->before_last = reader->last;
+    reader->last = reader->positions;
+    reader->positions = positions;
+    reader->decoded = -1;  // until the frame is complete
+    size_t count = 2 * reader->header->stars;
+    for (size_t i = 0; i < count; i++) {
+        uint64_t value = 0;
+        for (int shift = 0; ; shift += 7) {
+            if (in == in_end || shift > 63)
+                return false;
+            uint8_t byte = *in++;
+            value |= (uint64_t)(byte & 0x7F) << shift;
+            if (!(byte & 0x80))
+                break;
+        }
+        int64_t delta = (int64_t)(value >> 1) ^ -(int64_t)(value & 1);  // zigzag
+        int64_t prediction = since_key == 0 ? 0
+                : since_key == 1 ? reader->last[i] : 2*reader->last[i] - reader->before_last[i];
+        positions[i] = prediction + delta;
+    }
+    if (in != in_end)
+        return false;
+    reader->decoded = frame;
+    return true;
+}
+
+bool read_trajectory(trajectory_reader* reader, int64_t frame)
+{
+    if (frame < 0 || frame >= (int64_t)reader->chunks.size())
+        return false;
+    if (frame == reader->decoded)
+        return true;
+    int64_t key_interval = reader->header->key_interval;
+    int64_t key = frame > 0 ? (frame - 1) / key_interval * key_interval : 0;  // the last frame is needed too
+    if (reader->decoded < key || reader->decoded > frame)
+        reader->decoded = key - 1;
+    while (reader->decoded < frame)
+        if (!decode_next(reader))
+            return false;
+    return true;
+}
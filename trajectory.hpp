@@ -0,0 +1,87 @@
+#ifndef TRAJECTORY_H
+#define TRAJECTORY_H
+
+#include <string>
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Trajectory file, in the machine's byte order: a header, the colours of the stars, one chunk per recorded
+// frame, and the index of the chunks. A chunk holds the positions of all stars in the order of their ids, quantised to
+// [quantum], first all x then all y, as zigzag varints of their differences from a prediction,
+// compressed as a whole. The prediction is zero in a key frame, the previous position in the next
+// frame, and linear from the previous two positions after that.
+struct trajectory_header
+{
+    char magic[8];  // "CONTRAJ\0"
+    uint32_t version;
+    uint32_t header_size;
+    int64_t stars;
+    double quantum;  // position step
+    int32_t every;  // world frames between recorded frames
+    int32_t key_interval;  // recorded frames between key frames
+    int64_t frames;  // recorded frames in the index
+    int64_t index_offset;  // of the int64_t chunk offsets, zero if the file was not closed
+    int64_t color_offset;  // of the float red, green and blue of each star, right after the header
+};
+
+struct trajectory_chunk
+{
+    int64_t frame;  // world frame
+    double time;  // simulated time
+    uint32_t codec;
+    uint32_t key;  // whether the positions are not predicted
+    uint64_t raw_size;  // of the varints
+    uint64_t packed_size;  // of the data after this header
+};
+
+enum trajectory_codec : uint32_t
+{
+    codec_none,
+    codec_lz,  // lz.hpp
+    codec_zstd,
+};
+
+// Start writing the trajectory of the stars with the [color]s on its own thread; false with an error message
+// if the file cannot be created or the codec is not available
+bool open_trajectory(const std::string& filename, int64_t stars, const float* color, double quantum, int every,
+        const std::string& codec);
+
+// Buffer to fill with the quantised x and then y of all stars, or NULL if the writer is so far behind
+// that its queue is full, in which case the frame is dropped
+int64_t* trajectory_frame();
+
+// Queue the filled frame
+void push_trajectory_frame(int64_t frame, double time);
+
+// Write the queued frames and the index, and close the file
+void close_trajectory();
+
+// A trajectory file mapped for reading, and the last frames decoded from it
+struct trajectory_reader
+{
+    const trajectory_header* header;
+    std::vector<float> color;  // red, green and blue of each star, as recorded
+    std::vector<trajectory_chunk> chunks;  // of the recorded frames, copied as they are not aligned
+    std::vector<const uint8_t*> chunk_data;
+    int64_t decoded;  // recorded frame in [positions], -1 for none
+    int64_t* positions;  // quantised x and then y of the decoded frame
+    int64_t* last;  // of the frame before it
+    int64_t* before_last;
+    std::vector<int64_t> frames;  // storage of the three
+    std::vector<uint8_t> raw;  // decompressed varints
+    void* data;  // the file mapping
+    size_t size;
+};
+
+// Map a trajectory file read-only; false with an error message if it cannot be used. The chunks of a file
+// that was not closed are found by scanning it.
+bool map_trajectory(const std::string& filename, trajectory_reader* result);
+void unmap_trajectory(trajectory_reader* reader);
+
+// Decode a recorded frame into reader->positions and the one before it into reader->last, continuing from
+// the decoded frame when it is next, and from the nearest key frame otherwise; false if the file is corrupt
+bool read_trajectory(trajectory_reader* reader, int64_t frame);
+
+#endif // TRAJECTORY_H
@@ -6,66 +6,485 @@
 
 #include "world.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
 #include <assert.h>
-#include <pthread.h>
-#include <semaphore.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
 #include <unistd.h>
-#include <GLFW/glfw3.h>
 #include "linmath.h"
 #include "common.hpp"
+#include "fmm.hpp"
+#include "galaxy.hpp"
+#include "kernel.hpp"
+#include "pool.hpp"
+#include "scheduler.hpp"
+#include "snapshot.hpp"
+#include "trajectory.hpp"
 
-// Star or quadrant
-struct node: vecd2 // the vec2d is the center of mass
+// Stars in SoA form, sorted by their Morton keys, so every quadrant is a range of stars
+struct star_array
 {
-    double mass;
-    double size;  // zero for a star
+    double* x;
+    double* y;
+    double* mass;
+    double* speed_x;
+    double* speed_y;
+    double* accel_x;  // already multiplied by t/2, for better performance
+    double* accel_y;
+    double* step;  // time step of the current accel_x and accel_y, with config.time_bins > 0
+    int* level;  // time step bin: the step is frame_time / 2^level
+    int* id;  // index in disp_star_position and disp_star_color
 };
+static struct star_array stars = { 0 };
+static struct star_array sorted_stars = { 0 };  // reordering buffer
 
-static struct star: node
+// What the tree walk reads of a quad, packed so that it comes from one place instead of five columns.
+// A node takes 40 bytes (20 in float) with no alignment, so some straddle two cache lines; siblings are adjacent.
+template<typename real>
+struct walk_node
 {
-    struct vecd2 speed;
-    struct vecd2 accel;  // already multiplied by t/2, for better performance
-} *stars = NULL;
+    real x;  // center of mass
+    real y;
+    real mass;
+    real size;  // side length; after refits, at least the side of the stars' bounding box
+    uint32_t link;  // first child << 3 | child count, or first star << 3 for a leaf, which ends at quads.end
+};
 
-static struct quad: node
+// Linear quad-tree in SoA form; children of a quad are stored consecutively
+static struct quad_array
 {
-    struct vecd2 center; // geometrical center
-    struct quad* children[4];  // 4 quadrants
-} *quads = NULL;
+    double* x;  // center of mass
+    double* y;
+    double* mass;
+    double* cell;  // side length at the last build, with config.refit_frames > 0
+    double* xmin;  // bounding box of the stars, with config.refit_frames > 0
+    double* ymin;
+    double* xmax;
+    double* ymax;
+    double* speed_x;  // drift velocity of the center of mass, with config.time_bins > 0
+    double* speed_y;
+    double* qxx;  // second moments about the center of mass, with config.multipole >= 2
+    double* qxy;
+    double* qyy;
+    double* oxxx;  // third moments, with config.multipole >= 3
+    double* oxxy;
+    double* oxyy;
+    double* oyyy;
+    int* first_child;  // zero for a leaf
+    int* child_count;
+    int* begin;  // stars [begin, end)
+    int* end;
+    walk_node<double>* walk;  // with config.tree_precision == "double"; the only copy of the sizes
+    walk_node<float>* walk_float;  // otherwise
+} quads = { 0 };
+
+static struct interaction_list* interactions = NULL;  // one per thread
+static struct moment_list* moment_lists = NULL;  // higher moments of the same quads
+static int* groups = NULL;  // quads of at most config.group_size stars walking the tree together, in Morton order
+static int group_count;
+static double* new_accel_x = NULL;  // accelerations being calculated
+static double* new_accel_y = NULL;
+
+// Block time steps
+static int* group_levels = NULL;  // the finest time step bin among the stars of each group
+static int* active_groups = NULL;  // groups with stars whose time step ends at the current tick
+static double* active_x = NULL;  // positions of these stars, packed at the start of their group's range
+static double* active_y = NULL;
+static int active_count;
+static int tick;  // time in the frame, in the finest time steps
+static double tree_age;  // time since the tree's centers of mass were calculated
+
+// Radix sort buffers
+static uint64_t* keys = NULL;  // Morton keys, kept in the order of stars
+static uint64_t* keys_tmp = NULL;
+static int* order = NULL;  // star indices
+static int* order_tmp = NULL;
+
+// Parallel tree build state
+static size_t (*histograms)[256] = NULL;  // radix sort digit counts per thread
+static int sort_shift;  // current radix sort digit
+static int* child_ends = NULL;  // quadrant boundaries of the quads being split, 4 per quad
+static int* thread_sums = NULL;  // number of new quads per thread
+static int row_begin;  // quads of the current tree level
+static int row_end;
+static std::vector<int> rows;  // first quad of each tree level
+static bool refitting;  // the mass pass also refits the bounding boxes
+static int64_t* thread_interactions = NULL;  // star-body interactions of the force pass, per thread
+static int64_t build_interactions;  // interactions in the first frame after the last build
+static int frames_since_build;
+static int refit_limit;  // refits after the current build, adapted to how fast the tree degrades
+static int skipped_refits;  // builds since refitting stopped paying off
+static bool tree_degraded;  // rebuild at the next frame
+static int quad_capacity;  // allocated in quads, grown by whole chunks as the tree needs them
+static size_t quad_bytes;  // of one quad in all its columns
+static std::atomic<size_t> tree_bytes;  // of the quads in the last build
+static std::atomic<size_t> peak_tree_bytes;  // since init_world()
+static double (*thread_bounds)[4] = NULL;  // xmin, ymin, xmax, ymax of the stars drifted by each thread
+static double world_bounds[4];  // of all stars, found while drifting them
+static bool world_bounds_valid;
+static double drift_time;  // of the current drift_job
+static bool drift_final;  // the last drift of the frame also writes the display positions and the bounds
+static double root_xmin;
+static double root_ymin;
+static double root_size;
+static double key_scale;
 
 static int cores;
-static pthread_t *threads = NULL;  // thread pool
-static sem_t job_start;  // thread pool semaphores
-static sem_t job_finish;
+static ThreadPool pool;
+static WorkQueue work;  // chunks of the current job
+static double job_start_time;
+static double* thread_busy = NULL;  // time until each thread ran out of work
 static double frame_time;  // stays constant during a frame
+static int64_t frame_count;  // frames simulated, including those before a restart
+static double world_time;  // simulated time
+static snapshot* saving = NULL;  // being filled by snapshot_job
+static bool recording;  // the trajectory
+static int64_t* recorded = NULL;  // quantised positions being filled by trajectory_job
+
+// Replay of config.replay instead of the simulation
+static trajectory_reader replay = {};
+static int64_t replay_frame;  // recorded frame shown, interpolated towards the next one
+static double replay_time;  // in the recorded run
+static double replay_fraction;  // of the way to the next recorded frame
+static const int64_t* replay_from = NULL;  // quantised positions of the two frames
+static const int64_t* replay_to = NULL;
+static std::atomic<bool> replay_paused;
+static std::atomic<int> replay_seek;  // recorded frames to move by, from the render thread
+
+// Display positions, triple-buffered between the simulation and the render threads
+static vec2* position_buffers[3] = { NULL };
+static bool external_positions = false;  // position_buffers are owned by the renderer
+static int back_buffer;  // disp_star_position, being written by the simulation
+static int front_buffer;  // being drawn
+static std::atomic<int> middle_buffer;  // the latest complete positions, | fresh_positions if not acquired yet
+static const int fresh_positions = 4;
+static std::atomic<double> published_time;  // simulated time of the middle buffer
+static std::jthread world_thread;
+
+// Run the function in every thread and wait for all of them;
+// small jobs are run one part after another in the calling thread.
+static void run_job(void (*function)(int thread), bool parallel = true)
+{
+    if (!parallel || cores == 1) {
+        for (int i = 0; i < cores; i++)
+            function(i);
+        return;
+    }
+    pool.run(function);
+}
+
+// Start of the thread's part of [0, count), for the phases that need the same static partition
+// twice (radix sort counting and scattering, tree splitting and linking); others use the WorkQueue
+static inline int part_begin(int thread, int count)
+{
+    return (int)((int64_t)count * thread / cores);
+}
+
+static void alloc_stars(struct star_array* array, int count)
+{
+    array->x = (double*)malloc(count * sizeof(double));
+    array->y = (double*)malloc(count * sizeof(double));
+    array->mass = (double*)malloc(count * sizeof(double));
+    array->speed_x = (double*)malloc(count * sizeof(double));
+    array->speed_y = (double*)malloc(count * sizeof(double));
+    array->accel_x = (double*)calloc(count, sizeof(double));
+    array->accel_y = (double*)calloc(count, sizeof(double));
+    if (config.time_bins > 0) {
+        array->step = (double*)calloc(count, sizeof(double));
+        array->level = (int*)calloc(count, sizeof(int));
+    }
+    array->id = (int*)malloc(count * sizeof(int));
+}
+
+static void free_stars(struct star_array* array)
+{
+    free(array->x);
+    free(array->y);
+    free(array->mass);
+    free(array->speed_x);
+    free(array->speed_y);
+    free(array->accel_x);
+    free(array->accel_y);
+    free(array->step);
+    free(array->level);
+    free(array->id);
+    memset(array, 0, sizeof(*array));
+}
+
+// Resize the columns, keeping the first quads; returns the size of one quad
+static size_t resize_quads(struct quad_array* array, int count)
+{
+    int doubles = 3, ints = 4;
+    array->x = (double*)realloc(array->x, count * sizeof(double));
+    array->y = (double*)realloc(array->y, count * sizeof(double));
+    array->mass = (double*)realloc(array->mass, count * sizeof(double));
+    if (config.refit_frames > 0) {
+        doubles += 5;
+        array->cell = (double*)realloc(array->cell, count * sizeof(double));
+        array->xmin = (double*)realloc(array->xmin, count * sizeof(double));
+        array->ymin = (double*)realloc(array->ymin, count * sizeof(double));
+        array->xmax = (double*)realloc(array->xmax, count * sizeof(double));
+        array->ymax = (double*)realloc(array->ymax, count * sizeof(double));
+    }
+    if (config.time_bins > 0) {
+        doubles += 2;
+        array->speed_x = (double*)realloc(array->speed_x, count * sizeof(double));
+        array->speed_y = (double*)realloc(array->speed_y, count * sizeof(double));
+    }
+    if (config.multipole >= 2) {
+        doubles += 3;
+        array->qxx = (double*)realloc(array->qxx, count * sizeof(double));
+        array->qxy = (double*)realloc(array->qxy, count * sizeof(double));
+        array->qyy = (double*)realloc(array->qyy, count * sizeof(double));
+    }
+    if (config.multipole >= 3) {
+        doubles += 4;
+        array->oxxx = (double*)realloc(array->oxxx, count * sizeof(double));
+        array->oxxy = (double*)realloc(array->oxxy, count * sizeof(double));
+        array->oxyy = (double*)realloc(array->oxyy, count * sizeof(double));
+        array->oyyy = (double*)realloc(array->oyyy, count * sizeof(double));
+    }
+    array->first_child = (int*)realloc(array->first_child, count * sizeof(int));
+    array->child_count = (int*)realloc(array->child_count, count * sizeof(int));
+    array->begin = (int*)realloc(array->begin, count * sizeof(int));
+    array->end = (int*)realloc(array->end, count * sizeof(int));
+    size_t node_size;
+    if (config.tree_precision == "float") {
+        array->walk_float = (walk_node<float>*)realloc(array->walk_float, count * sizeof(walk_node<float>));
+        node_size = sizeof(walk_node<float>);
+    } else {
+        array->walk = (walk_node<double>*)realloc(array->walk, count * sizeof(walk_node<double>));
+        node_size = sizeof(walk_node<double>);
+    }
+    return doubles * sizeof(double) + ints * sizeof(int) + node_size;
+}
+
+// Make room for [count] quads, with some headroom for the tree to grow in the next builds
+static void reserve_quads(int count)
+{
+    const int quad_pool_chunk = 1 << 16;
+    if (count <= quad_capacity)
+        return;
+    int64_t capacity = std::max<int64_t>(count, quad_capacity + quad_capacity / 8);
+    capacity = (capacity + quad_pool_chunk - 1) / quad_pool_chunk * quad_pool_chunk;
+    capacity = std::min<int64_t>(capacity, 2 * (int64_t)config.stars);  // the most a compressed tree can have
+    quad_capacity = std::max(count, (int)capacity);
+    quad_bytes = resize_quads(&quads, quad_capacity);
+}
+
+static void free_quads(struct quad_array* array)
+{
+    free(array->x);
+    free(array->y);
+    free(array->mass);
+    free(array->cell);
+    free(array->xmin);
+    free(array->ymin);
+    free(array->xmax);
+    free(array->ymax);
+    free(array->speed_x);
+    free(array->speed_y);
+    free(array->qxx);
+    free(array->qxy);
+    free(array->qyy);
+    free(array->oxxx);
+    free(array->oxxy);
+    free(array->oxyy);
+    free(array->oyyy);
+    free(array->first_child);
+    free(array->child_count);
+    free(array->begin);
+    free(array->end);
+    free(array->walk);
+    free(array->walk_float);
+    memset(array, 0, sizeof(*array));
+}
+
+// Copy the stars into the snapshot in the order of their ids
+static void snapshot_job(int thread)
+{
+    int begin, end;
+    while (work.next(thread, &begin, &end)) {
+        for (int i = begin; i < end; i++) {
+            int j = stars.id[i];
+            saving->x[j] = stars.x[i];
+            saving->y[j] = stars.y[i];
+            saving->speed_x[j] = stars.speed_x[i];
+            saving->speed_y[j] = stars.speed_y[i];
+            saving->accel_x[j] = stars.accel_x[i];
+            saving->accel_y[j] = stars.accel_y[i];
+            saving->mass[j] = stars.mass[i];
+            if (config.time_bins > 0) {
+                saving->step[j] = stars.step[i];
+                saving->level[j] = stars.level[i];
+            }
+        }
+    }
+}
+
+// Quantise the positions into the trajectory frame in the order of star ids, all x and then all y
+static void trajectory_job(int thread)
+{
+    int begin, end;
+    while (work.next(thread, &begin, &end)) {
+        for (int i = begin; i < end; i++) {
+            recorded[stars.id[i]] = llround(stars.x[i] / config.traj_quantum);
+            recorded[config.stars + stars.id[i]] = llround(stars.y[i] / config.traj_quantum);
+        }
+    }
+}
+
+// Hand the current positions over to the trajectory writer, unless it is too far behind
+static void record_trajectory()
+{
+    const int star_chunk = 4096;
+    recorded = trajectory_frame();
+    if (!recorded)
+        return;
+    double perf_start = get_time();
+    work.reset(config.stars, star_chunk);
+    run_job(trajectory_job, config.stars >= star_chunk);
+    push_trajectory_frame(frame_count, world_time);
+    recorded = NULL;
+    trace_event("trajectory", perf_start, get_time());
+}
+
+// Open config.trajectory with the colours of the stars and record the first frame
+static void start_trajectory()
+{
+    recording = !config.trajectory.empty() && config.traj_every > 0 && config.traj_quantum > 0
+            && open_trajectory(config.trajectory, config.stars, (const float*)disp_star_color, config.traj_quantum,
+                    config.traj_every, config.traj_compress);
+    if (recording)
+        record_trajectory();
+}
+
+// Take a snapshot of the current frame and write it to config.snapshot in the background
+static void save_snapshot()
+{
+    const int star_chunk = 4096;
+    double perf_start = get_time();
+    saving = begin_snapshot(config.stars);
+    saving->header->frame = frame_count;
+    saving->header->time = world_time;
+    saving->header->frame_time = frame_time;
+    work.reset(config.stars, star_chunk);
+    run_job(snapshot_job, config.stars >= star_chunk);
+    memcpy(saving->color, disp_star_color, config.stars * sizeof(vec3));
+    write_snapshot(config.snapshot);
+    saving = NULL;
+    trace_event("snapshot", perf_start, get_time());
+}
+
+// Resume from a mapped snapshot of config.stars stars. The tree is not saved, so the next frame builds
+// a new one: with refits, the run then differs from one that was not interrupted.
+static void load_snapshot(const snapshot* snap)
+{
+    frame_count = snap->header->frame;
+    world_time = snap->header->time;
+    memcpy(stars.x, snap->x, config.stars * sizeof(double));
+    memcpy(stars.y, snap->y, config.stars * sizeof(double));
+    memcpy(stars.speed_x, snap->speed_x, config.stars * sizeof(double));
+    memcpy(stars.speed_y, snap->speed_y, config.stars * sizeof(double));
+    memcpy(stars.accel_x, snap->accel_x, config.stars * sizeof(double));
+    memcpy(stars.accel_y, snap->accel_y, config.stars * sizeof(double));
+    memcpy(stars.mass, snap->mass, config.stars * sizeof(double));
+    if (config.time_bins > 0) {
+        memcpy(stars.step, snap->step, config.stars * sizeof(double));
+        for (int i = 0; i < config.stars; i++)
+            stars.level[i] = std::min(snap->level[i], config.time_bins);
+    }
+    memcpy(disp_star_color, snap->color, config.stars * sizeof(vec3));
+    for (int i = 0; i < config.stars; i++) {
+        stars.id[i] = i;
+        for (int buffer = 0; buffer < 3; buffer++) {
+            position_buffers[buffer][i][0] = stars.x[i];
+            position_buffers[buffer][i][1] = stars.y[i];
+        }
+    }
+}
 
 void finalize_world()
 {
-    if (threads) {
-        for (int i = 1; i < cores; i++)
-            pthread_cancel(threads[i]);
-        for (int i = 1; i < cores; i++)
-            pthread_join(threads[i], NULL);
-        sem_destroy(&job_start);
-        sem_destroy(&job_finish);
-        free(threads);
-        threads = NULL;
+    stop_world_thread();
+    unmap_trajectory(&replay);
+    if (!config.snapshot.empty() && stars.x)
+        save_snapshot();
+    finish_snapshot();
+    close_trajectory();
+    recording = false;
+    finalize_fmm();
+    pool.stop();
+    if (histograms) {
+        free(histograms);
+        free(child_ends);
+        free(thread_sums);
+        free(thread_busy);
+        free(thread_interactions);
+        free(thread_bounds);
+        thread_interactions = NULL;
+        thread_bounds = NULL;
+        histograms = NULL;
+        thread_busy = NULL;
+        child_ends = NULL;
+        thread_sums = NULL;
+    }
+    if (interactions) {
+        for (int i = 0; i < cores; i++)
+            free_interaction_list(&interactions[i]);
+        free(interactions);
+        interactions = NULL;
+        for (int i = 0; i < cores; i++)
+            free_moment_list(&moment_lists[i]);
+        free(moment_lists);
+        moment_lists = NULL;
     }
-    if (stars) {
-        free(stars);
-        stars = NULL;
+    if (groups) {
+        free(groups);
+        free(group_levels);
+        free(active_groups);
+        free(active_x);
+        free(active_y);
+        free(new_accel_x);
+        free(new_accel_y);
+        groups = NULL;
+        group_levels = NULL;
+        active_groups = NULL;
+        active_x = NULL;
+        active_y = NULL;
+        new_accel_x = NULL;
+        new_accel_y = NULL;
     }
-    if (quads) {
-        free(quads);
-        quads = NULL;
+    free_stars(&stars);
+    free_stars(&sorted_stars);
+    free_quads(&quads);
+    rows.clear();
+    if (keys) {
+        free(keys);
+        free(keys_tmp);
+        free(order);
+        free(order_tmp);
+        keys = NULL;
+        keys_tmp = NULL;
+        order = NULL;
+        order_tmp = NULL;
     }
     if (disp_star_position) {
-        free(disp_star_position);
+        for (int i = 0; i < 3; i++) {
+            if (!external_positions)
+                free(position_buffers[i]);
+            position_buffers[i] = NULL;
+        }
+        external_positions = false;
         disp_star_position = NULL;
     }
     if (disp_star_color) {
@@ -74,55 +493,235 @@ void finalize_world()
     }
 }
 
-// Recursive walk through the qtree
-static void get_accel(struct star* star, const struct quad* node, struct vecd2* accel)
+// Stack-based walk through the qtree, collecting everything that attracts any star of the group.
+// A quad is taken whole only if it is far enough from the group's bounding box.
+template<typename real>
+static void get_interactions(const walk_node<real>* nodes, const double* x, const double* y, int count,
+        struct interaction_list* list, struct moment_list* moments)
 {
-    double dx = node->x - star->x;
-    double dy = node->y - star->y;
-    double distance_sqr = dx*dx + dy*dy;
-    if (sqrt(distance_sqr) > node->size * config.accuracy) {
-        double angle = atan2(dy, dx);
-        double accel_abs = node->mass / (distance_sqr + config.epsilon);
-        accel->x += accel_abs * cos(angle);
-        accel->y += accel_abs * sin(angle);
-    } else if (node->size) {
-        if (node->children[0])
-            get_accel(star, node->children[0], accel);
-        if (node->children[1])
-            get_accel(star, node->children[1], accel);
-        if (node->children[2])
-            get_accel(star, node->children[2], accel);
-        if (node->children[3])
-            get_accel(star, node->children[3], accel);
-    } // else the same star or another star with the same coordinates
+    double xmin = INFINITY, ymin = INFINITY, xmax = -INFINITY, ymax = -INFINITY;
+    for (int i = 0; i < count; i++) {
+        xmin = std::min(xmin, x[i]);
+        xmax = std::max(xmax, x[i]);
+        ymin = std::min(ymin, y[i]);
+        ymax = std::max(ymax, y[i]);
+    }
+
+    int stack[128];  // the tree is at most 33 levels deep, with at most 3 pending siblings per level
+    int stack_size = 0;
+    stack[stack_size++] = 0;
+    while (stack_size) {
+        int quad = stack[--stack_size];
+        const walk_node<real>& node = nodes[quad];
+        double x = node.x;
+        double y = node.y;
+        if (sizeof(real) < sizeof(double) && (!(node.link & 0x7) || node.size < (std::abs(x) + std::abs(y)) * 0x1p-16)) {
+            // A rounded center may fall just outside a quad near the float resolution and pass the opening
+            // test for the quad's own stars, which the kernel would then no longer skip; such quads and all
+            // leaves are judged in full precision
+            x = quads.x[quad];
+            y = quads.y[quad];
+        }
+        if (quads.speed_x) {  // predicted between the block time steps
+            x += tree_age * quads.speed_x[quad];
+            y += tree_age * quads.speed_y[quad];
+        }
+        double dx = std::max(std::max(xmin - x, x - xmax), 0.0);  // to the closest point of the box
+        double dy = std::max(std::max(ymin - y, y - ymax), 0.0);
+        double distance_sqr = dx*dx + dy*dy;
+        int first = node.link >> 3;
+        int child_count = node.link & 0x7;
+        if (sqrt(distance_sqr) > node.size * config.accuracy) {
+            push_interaction(list, x, y, node.mass);
+            bool point = !child_count && (config.leaf_size <= 1 || quads.end[quad] - first == 1);
+            if (config.multipole >= 3 && !point)
+                push_moments(moments, x, y, quads.qxx[quad], quads.qxy[quad], quads.qyy[quad],
+                        quads.oxxx[quad], quads.oxxy[quad], quads.oxyy[quad], quads.oyyy[quad]);
+            else if (config.multipole == 2 && !point)
+                push_moments(moments, x, y, quads.qxx[quad], quads.qxy[quad], quads.qyy[quad],
+                        0, 0, 0, 0);
+        } else if (child_count) {
+            for (int i = first + child_count - 1; i >= first; i--)
+                stack[stack_size++] = i;
+        } else {
+            // Summed directly by the kernel, which skips the star itself and other stars in the same point
+            for (int i = first; i < quads.end[quad]; i++)
+                push_interaction(list, stars.x[i], stars.y[i], stars.mass[i]);
+        }
+    }
+}
+
+// Velocity update from the new accelerations
+static inline void kick(int begin, int end)
+{
+    for (int i = begin; i < end; i++) {
+        double accel_x = new_accel_x[i] * frame_time * config.gravity / 2;
+        double accel_y = new_accel_y[i] * frame_time * config.gravity / 2;
+        stars.speed_x[i] += stars.accel_x[i] + accel_x;  // velocity Verlet integration
+        stars.speed_y[i] += stars.accel_y[i] + accel_y;
+        stars.accel_x[i] = accel_x;
+        stars.accel_y[i] = accel_y;
+    }
+}
+
+// Whether the steps of the time step bin end at the current tick
+static inline bool bin_active(int level)
+{
+    return !(tick & ((1 << (config.time_bins - level)) - 1));
+}
+
+// Copy the stars whose time step ends at the current tick to the start of their range in active_x and active_y.
+// Returns their number.
+static inline int gather_active(int begin, int end)
+{
+    int count = 0;
+    for (int i = begin; i < end; i++) {
+        if (bin_active(stars.level[i])) {
+            active_x[begin + count] = stars.x[i];
+            active_y[begin + count] = stars.y[i];
+            count++;
+        }
+    }
+    return count;
+}
+
+// Kick the stars whose time step ends at the current tick, and put them into new time step bins:
+// the finest of the acceleration criterion sqrt(2 η ε / |a|) and the jerk criterion η |a| / |da/dt|,
+// with the jerk estimated from the previous step. A star may only move to a coarser bin at its boundary.
+// Their new accelerations are at the start of the range, in the order of gather_active().
+// Returns the finest bin among the stars.
+static inline int block_kick(int begin, int end)
+{
+    int finest = 0;
+    int active = begin;
+    for (int i = begin; i < end; i++) {
+        if (!bin_active(stars.level[i])) {
+            finest = std::max(finest, stars.level[i]);
+            continue;  // in the middle of its step
+        }
+        double accel_x = new_accel_x[active] * config.gravity;
+        double accel_y = new_accel_y[active] * config.gravity;
+        active++;
+        double accel = sqrt(accel_x*accel_x + accel_y*accel_y);
+        double step = sqrt(2 * config.step_accuracy * sqrt(config.epsilon) / accel);
+        if (stars.step[i] > 0) {
+            double jerk_x = (accel_x - 2 * stars.accel_x[i] / stars.step[i]) / stars.step[i];
+            double jerk_y = (accel_y - 2 * stars.accel_y[i] / stars.step[i]) / stars.step[i];
+            step = std::min(step, config.step_accuracy * accel / sqrt(jerk_x*jerk_x + jerk_y*jerk_y));
+        }
+        int level = 0;
+        while (level < config.time_bins && (ldexp(frame_time, -level) > step || !bin_active(level)))
+            level++;
+        step = ldexp(frame_time, -level);
+        stars.speed_x[i] += stars.accel_x[i] + accel_x * stars.step[i] / 2;  // velocity Verlet, closing the old step
+        stars.speed_y[i] += stars.accel_y[i] + accel_y * stars.step[i] / 2;
+        stars.accel_x[i] = accel_x * step / 2;
+        stars.accel_y[i] = accel_y * step / 2;
+        stars.step[i] = step;
+        stars.level[i] = level;
+        finest = std::max(finest, level);
+    }
+    return finest;
 }
 
 static void update_stars(int thread)
 {
-    for (int i = thread; i < config.stars; i += cores) {
-         struct vecd2 accel = { 0 };
-         get_accel(&stars[i], &quads[0], &accel);
-         accel.x *= frame_time * config.gravity / 2;
-         accel.y *= frame_time * config.gravity / 2;
-         stars[i].speed.x += stars[i].accel.x + accel.x;  // velocity Verlet integration
-         stars[i].speed.y += stars[i].accel.y + accel.y;
-         stars[i].accel = accel;
-     }
+    struct interaction_list* list = &interactions[thread];
+    struct moment_list* moments = &moment_lists[thread];
+    int chunk_begin, chunk_end;
+    while (work.next(thread, &chunk_begin, &chunk_end))
+    for (int index = chunk_begin; index < chunk_end; index++) {
+        int group = config.time_bins > 0 ? active_groups[index] : index;
+        int begin = quads.begin[groups[group]];
+        int end = quads.end[groups[group]];
+        const double* x = &stars.x[begin];
+        const double* y = &stars.y[begin];
+        int count = end - begin;
+        if (config.time_bins > 0) {  // only the stars at the end of their steps
+            count = gather_active(begin, end);
+            x = &active_x[begin];
+            y = &active_y[begin];
+        }
+        list->count = 0;
+        moments->count = 0;
+        if (quads.walk)
+            get_interactions(quads.walk, x, y, count, list, moments);
+        else
+            get_interactions(quads.walk_float, x, y, count, list, moments);
+        thread_interactions[thread] += (int64_t)list->count * count;
+        for (int i = begin; i < begin + count; i++) {
+            new_accel_x[i] = 0;
+            new_accel_y[i] = 0;
+        }
+        accel_kernel(x, y, count, list, config.epsilon, &new_accel_x[begin], &new_accel_y[begin]);
+        if (moments->count)
+            moment_kernel(x, y, count, moments, config.multipole, config.epsilon,
+                    &new_accel_x[begin], &new_accel_y[begin]);
+        if (config.time_bins > 0)
+            group_levels[group] = block_kick(begin, end);
+        else
+            kick(begin, end);
+    }
+    thread_busy[thread] = get_time() - job_start_time;
 }
 
-// Sleeps in the pool until job_start is fired.
-static void* update_stars_job(void* arg)
+static void kick_job(int thread)
 {
-    pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL); // can be safely cancelled at any time.
-    int thread = (int)(intptr_t)arg;
+    int begin, end;
+    while (work.next(thread, &begin, &end))
+        kick(begin, end);
+}
 
-    while (true) {
-        sem_wait(&job_start);
-        update_stars(thread);
-        sem_post(&job_finish);
+// Drift the stars and, in the same pass, convert them to the display coordinates and find their bounds
+static void drift_job(int thread)
+{
+    double xmin = INFINITY, ymin = INFINITY, xmax = -INFINITY, ymax = -INFINITY;
+    int begin, end;
+    while (work.next(thread, &begin, &end)) {
+        if (!drift_final) {
+            for (int i = begin; i < end; i++) {
+                stars.x[i] += drift_time * (stars.speed_x[i] + stars.accel_x[i]);  // velocity Verlet integration
+                stars.y[i] += drift_time * (stars.speed_y[i] + stars.accel_y[i]);
+            }
+            continue;
+        }
+        for (int i = begin; i < end; i++) {
+            double x = stars.x[i] + drift_time * (stars.speed_x[i] + stars.accel_x[i]);
+            double y = stars.y[i] + drift_time * (stars.speed_y[i] + stars.accel_y[i]);
+            stars.x[i] = x;
+            stars.y[i] = y;
+            disp_star_position[stars.id[i]][0] = x;
+            disp_star_position[stars.id[i]][1] = y;
+            xmin = std::min(xmin, x);
+            ymin = std::min(ymin, y);
+            xmax = std::max(xmax, x);
+            ymax = std::max(ymax, y);
+        }
     }
+    thread_bounds[thread][0] = xmin;
+    thread_bounds[thread][1] = ymin;
+    thread_bounds[thread][2] = xmax;
+    thread_bounds[thread][3] = ymax;
+}
 
-    return NULL;
+static void drift(double time, bool final)
+{
+    const int star_chunk = 4096;
+    drift_time = time;
+    drift_final = final;
+    work.reset(config.stars, star_chunk);
+    run_job(drift_job, config.stars >= star_chunk);
+    if (!final)
+        return;
+    world_bounds[0] = world_bounds[1] = INFINITY;
+    world_bounds[2] = world_bounds[3] = -INFINITY;
+    for (int thread = 0; thread < cores; thread++) {
+        world_bounds[0] = std::min(world_bounds[0], thread_bounds[thread][0]);
+        world_bounds[1] = std::min(world_bounds[1], thread_bounds[thread][1]);
+        world_bounds[2] = std::max(world_bounds[2], thread_bounds[thread][2]);
+        world_bounds[3] = std::max(world_bounds[3], thread_bounds[thread][3]);
+    }
+    world_bounds_valid = true;
 }
 
 // Taken from https://academo.org/demos/colour-temperature-relationship
@@ -152,86 +751,706 @@ void temperature_to_color(double temperature, vec3 color)
         color[2] = 1;
 }
 
-static inline double frand(double min, double max)
+// Place the stars of a new galaxy
+static void galaxy_job(int thread)
 {
-    return (double)rand()/RAND_MAX * (max-min) + min;
+    int begin, end;
+    while (work.next(thread, &begin, &end)) {
+        for (int i = begin; i < end; i++) {
+            galaxy_star star = make_star(i);
+            stars.x[i] = star.x;
+            stars.y[i] = star.y;
+            stars.speed_x[i] = star.speed_x;
+            stars.speed_y[i] = star.speed_y;
+            stars.mass[i] = star.mass;
+            stars.id[i] = i;
+            temperature_to_color(stars.mass[i] * 1500, disp_star_color[i]);
+            for (int buffer = 0; buffer < 3; buffer++) {
+                position_buffers[buffer][i][0] = stars.x[i];
+                position_buffers[buffer][i][1] = stars.y[i];
+            }
+        }
+    }
 }
 
-// assists qsorting
-static int mass_ascending(const void *a, const void *b)
+// Interpolate the display positions between the recorded frames
+static void replay_job(int thread)
 {
-    if (((struct star*)a)->mass < ((struct star*)b)->mass) return -1;
-    if (((struct star*)a)->mass > ((struct star*)b)->mass) return 1;
-    return 0;
+    double quantum = replay.header->quantum;
+    int begin, end;
+    while (work.next(thread, &begin, &end)) {
+        for (int i = begin; i < end; i++) {
+            int j = config.stars + i;
+            disp_star_position[i][0] = quantum * (replay_from[i] + replay_fraction * (replay_to[i] - replay_from[i]));
+            disp_star_position[i][1] = quantum * (replay_from[j] + replay_fraction * (replay_to[j] - replay_from[j]));
+        }
+    }
+}
+
+// Write the display positions at replay_time, between replay_frame and the next recorded frame;
+// false if they could not be decoded
+static bool show_replay()
+{
+    const int star_chunk = 4096;
+    int64_t next = std::min(replay_frame + 1, (int64_t)replay.chunks.size() - 1);
+    if (!read_trajectory(&replay, next)) {
+        fprintf(stderr, "Trajectory '%s' is damaged at frame %ld\n", config.replay.c_str(), (long)next);
+        replay_paused = true;
+        return false;
+    }
+    double from_time = replay.chunks[replay_frame].time;
+    double to_time = replay.chunks[next].time;
+    replay_from = next > replay_frame ? replay.last : replay.positions;
+    replay_to = replay.positions;
+    replay_fraction = to_time > from_time ? std::clamp((replay_time - from_time) / (to_time - from_time), 0.0, 1.0) : 0;
+    work.reset(config.stars, star_chunk);
+    run_job(replay_job, config.stars >= star_chunk);
+    return true;
+}
+
+// Advance the replay by the frame time, looping at the end, or move it by the frames seeked to;
+// false if the display positions are unchanged
+static bool replay_world_frame(double time)
+{
+    int64_t count = replay.chunks.size();
+    int seek = replay_seek.exchange(0);
+    if (seek) {
+        replay_frame = ((replay_frame + seek) % count + count) % count;
+        replay_time = replay.chunks[replay_frame].time;
+    } else if (!replay_paused) {
+        replay_time += std::min(time, 1/config.min_fps) * config.speed;
+        if (replay_time > replay.chunks[count - 1].time) {
+            replay_frame = 0;
+            replay_time = replay.chunks[0].time;
+        }
+        while (replay_frame + 1 < count && replay.chunks[replay_frame + 1].time <= replay_time)
+            replay_frame++;
+    } else {
+        return false;
+    }
+    return show_replay();
+}
+
+// Take the stars from the mapped config.replay instead of simulating them
+static void init_replay()
+{
+    work.init(cores);
+    for (int i = 0; i < 3; i++)
+        position_buffers[i] = (vec2*)malloc(config.stars * sizeof(vec2));
+    back_buffer = 0;
+    middle_buffer = 1;
+    front_buffer = 2;
+    disp_star_position = position_buffers[back_buffer];
+    disp_star_color = (vec3*)malloc(config.stars * sizeof(vec3));
+    memcpy(disp_star_color, replay.color.data(), config.stars * sizeof(vec3));
+    replay_frame = 0;
+    replay_time = replay.chunks[0].time;
+    replay_paused = false;
+    replay_seek = 0;
+    show_replay();
+    for (int buffer = 1; buffer < 3; buffer++)
+        memcpy(position_buffers[buffer], disp_star_position, config.stars * sizeof(vec2));
+    published_time = replay_time;
 }
 
 void init_world()
 {
+    snapshot restart = { 0 };
+    if (!config.replay.empty() && map_trajectory(config.replay, &replay) && !read_trajectory(&replay, 0)) {
+        fprintf(stderr, "Trajectory '%s' is damaged at frame 0\n", config.replay.c_str());
+        unmap_trajectory(&replay);
+    }
+    if (replay.data)
+        config.stars = replay.header->stars;
+    else if (!config.restart.empty() && !map_snapshot(config.restart, &restart))
+        exit(1);  // a new galaxy would overwrite the snapshot at exit if it is also config.snapshot
+    if (restart.data)
+        config.stars = restart.header->stars;
     assert(config.stars > 1);
+    assert(config.stars < 1 << 28);  // 2N quads fit in the 29 bits of walk_node::link
+    assert(config.time_bins < 31);
 
     // Init threads
-    cores = sysconf(_SC_NPROCESSORS_ONLN);
+    cores = config.threads > 0 ? config.threads : sysconf(_SC_NPROCESSORS_ONLN);
     #if 0
         #warning single-threaded
         cores = 1;
     #endif
-    if (cores > 1) {
-        sem_init(&job_start, 0, 0);
-        sem_init(&job_finish, 0, 0);
-        threads = (pthread_t*)malloc(cores * sizeof(pthread_t));
-        for (int i = 1; i < cores; i++)  // job #0 is run synchronously
-            pthread_create(&threads[i], NULL, &update_stars_job, (void*)(intptr_t)i);
+    pool.start(cores, config.affinity);
+    if (replay.data) {
+        init_replay();
+        return;
+    }
+    histograms = (size_t(*)[256])malloc(cores * sizeof(*histograms));
+    child_ends = (int*)malloc(4 * config.stars * sizeof(int));
+    thread_sums = (int*)malloc(cores * sizeof(int));
+    thread_interactions = (int64_t*)calloc(cores, sizeof(int64_t));
+    thread_busy = (double*)calloc(cores, sizeof(double));
+    thread_bounds = (double(*)[4])malloc(cores * sizeof(*thread_bounds));
+    world_bounds_valid = false;
+    work.init(cores);
+    interactions = (struct interaction_list*)calloc(cores, sizeof(struct interaction_list));
+    moment_lists = (struct moment_list*)calloc(cores, sizeof(struct moment_list));
+    groups = (int*)malloc(config.stars * sizeof(int));
+    if (config.time_bins > 0) {
+        group_levels = (int*)malloc(config.stars * sizeof(int));
+        active_groups = (int*)malloc(config.stars * sizeof(int));
+        active_x = (double*)malloc(config.stars * sizeof(double));
+        active_y = (double*)malloc(config.stars * sizeof(double));
     }
+    new_accel_x = (double*)malloc(config.stars * sizeof(double));
+    new_accel_y = (double*)malloc(config.stars * sizeof(double));
+    init_kernel();
+    init_fmm(&pool);
 
     // Init stars
-    stars = (struct star*)calloc(config.stars, sizeof(struct star));
-    quads = (struct quad*)calloc(2 * config.stars, sizeof(struct quad));  // TODO: dynamic reallocation
-    disp_star_position = (vec2*)malloc(config.stars * sizeof(vec2));
+    alloc_stars(&stars, config.stars);
+    alloc_stars(&sorted_stars, config.stars);
+    tree_bytes = 0;
+    peak_tree_bytes = 0;
+    quad_capacity = 0;
+    reserve_quads(std::max(1, config.stars / std::max(config.leaf_size, 1)));  // at least the root
+    refit_limit = config.refit_frames;
+    skipped_refits = 0;
+    keys = (uint64_t*)malloc(config.stars * sizeof(uint64_t));
+    keys_tmp = (uint64_t*)malloc(config.stars * sizeof(uint64_t));
+    order = (int*)malloc(config.stars * sizeof(int));
+    order_tmp = (int*)malloc(config.stars * sizeof(int));
+    for (int i = 0; i < 3; i++)
+        position_buffers[i] = (vec2*)malloc(config.stars * sizeof(vec2));
+    back_buffer = 0;
+    middle_buffer = 1;
+    front_buffer = 2;
+    disp_star_position = position_buffers[back_buffer];
     disp_star_color = (vec3*)malloc(config.stars * sizeof(vec3));
-    double rmax = sqrt(config.stars) / config.galaxy_density;
-    for (int i = 0; i < config.stars; i++) {
-        double r = frand(0, rmax);
-        double dir = frand(0, 2*M_PI);
-        stars[i].x = r * cos(dir);
-        stars[i].y = r * sin(dir);
-        stars[i].speed.x =  config.star_speed * pow(r, 0.25) * sin(dir);
-        stars[i].speed.y = -config.star_speed * pow(r, 0.25) * cos(dir);
-        stars[i].mass = frand(1, 10);
-        temperature_to_color(stars[i].mass * 1500, disp_star_color[i]);
+    frame_count = 0;
+    world_time = 0;
+    published_time = 0;
+    if (restart.data) {
+        load_snapshot(&restart);
+        unmap_snapshot(&restart);
+        start_trajectory();
+        return;
+    }
+    if (!config.seed) {
+        config.seed = std::chrono::system_clock::now().time_since_epoch().count();
+        fprintf(stderr, "Random seed: %llu\n", config.seed);
     }
-    qsort(stars, config.stars, sizeof(struct star), mass_ascending);  // increases accumulation accuracy
+    init_galaxy();
+    const int star_chunk = 4096;
+    work.reset(config.stars, star_chunk);
+    run_job(galaxy_job, config.stars >= star_chunk);
 
     #if 0
         config.stars = 3;
-        stars[0].x = 0.05;
-        stars[0].y = 0;
-        stars[0].speed.x = 0;
-        stars[0].speed.y = -0.0;
-        stars[0].mass = 1;
-        stars[1].x = -0.05;
-        stars[1].y = 0;
-        stars[1].speed.x = 0;
-        stars[1].speed.y = 0.0;
-        stars[1].mass = 1;
-        stars[2].x = 1000;
-        stars[2].y = 1000;
+        stars.x[0] = 0.05;
+        stars.y[0] = 0;
+        stars.speed_x[0] = 0;
+        stars.speed_y[0] = -0.0;
+        stars.mass[0] = 1;
+        stars.x[1] = -0.05;
+        stars.y[1] = 0;
+        stars.speed_x[1] = 0;
+        stars.speed_y[1] = 0.0;
+        stars.mass[1] = 1;
+        stars.x[2] = 1000;
+        stars.y[2] = 1000;
     #endif
+    start_trajectory();
+}
+
+// Interleave the bits of a 32-bit coordinate with zeros
+static inline uint64_t spread_bits(uint32_t value)
+{
+    uint64_t bits = value;
+    bits = (bits | (bits << 16)) & 0x0000FFFF0000FFFF;
+    bits = (bits | (bits << 8))  & 0x00FF00FF00FF00FF;
+    bits = (bits | (bits << 4))  & 0x0F0F0F0F0F0F0F0F;
+    bits = (bits | (bits << 2))  & 0x3333333333333333;
+    bits = (bits | (bits << 1))  & 0x5555555555555555;
+    return bits;
 }
 
+// Z-curve position in the root quad; each pair of bits is a quadrant:
 // 2 3
 // 0 1
-static inline int get_quadrant(const struct quad *quad, const struct star *star)
+static inline uint64_t morton_key(double x, double y, double xmin, double ymin, double scale)
+{
+    x = (x - xmin) * scale;
+    y = (y - ymin) * scale;
+    uint32_t qx = x < UINT32_MAX ? (uint32_t)x : UINT32_MAX;
+    uint32_t qy = y < UINT32_MAX ? (uint32_t)y : UINT32_MAX;
+    return spread_bits(qx) | (spread_bits(qy) << 1);
+}
+
+// Number of common quadrant levels of two keys, 32 for equal keys
+static inline int common_levels(uint64_t a, uint64_t b)
+{
+    return a == b ? 32 : __builtin_clzll(a ^ b) / 2;
+}
+
+static void key_job(int thread)
+{
+    int begin, end;
+    while (work.next(thread, &begin, &end)) {
+        for (int i = begin; i < end; i++) {
+            keys[i] = morton_key(stars.x[i], stars.y[i], root_xmin, root_ymin, key_scale);
+            order[i] = i;
+        }
+    }
+}
+
+static void sort_count_job(int thread)
+{
+    size_t* histogram = histograms[thread];
+    memset(histogram, 0, sizeof(*histograms));
+    for (int i = part_begin(thread, config.stars); i < part_begin(thread + 1, config.stars); i++)
+        histogram[(keys[i] >> sort_shift) & 0xFF]++;
+}
+
+// Histograms already hold the thread's first position for each digit
+static void sort_scatter_job(int thread)
+{
+    size_t* offsets = histograms[thread];
+    for (int i = part_begin(thread, config.stars); i < part_begin(thread + 1, config.stars); i++) {
+        size_t j = offsets[(keys[i] >> sort_shift) & 0xFF]++;
+        keys_tmp[j] = keys[i];
+        order_tmp[j] = order[i];
+    }
+}
+
+// LSD radix sort of (keys, order) pairs by 8 bits at a time; stable, so the
+// result does not depend on the number of threads
+static void radix_sort()
+{
+    for (sort_shift = 0; sort_shift < 64; sort_shift += 8) {
+        run_job(sort_count_job);
+        size_t sum = 0;
+        bool same_digit = false;
+        for (int digit = 0; digit < 256; digit++) {
+            size_t digit_sum = sum;
+            for (int thread = 0; thread < cores; thread++) {
+                size_t count = histograms[thread][digit];
+                histograms[thread][digit] = sum;
+                sum += count;
+            }
+            if (sum - digit_sum == (size_t)config.stars)
+                same_digit = true;
+        }
+        if (same_digit)
+            continue;
+        run_job(sort_scatter_job);
+        uint64_t* keys_swap = keys;
+        keys = keys_tmp;
+        keys_tmp = keys_swap;
+        int* order_swap = order;
+        order = order_tmp;
+        order_tmp = order_swap;
+    }
+}
+
+static void gather_job(int thread)
+{
+    int begin, end;
+    while (work.next(thread, &begin, &end)) {
+        for (int i = begin; i < end; i++) {
+            int j = order[i];
+            sorted_stars.x[i] = stars.x[j];
+            sorted_stars.y[i] = stars.y[j];
+            sorted_stars.mass[i] = stars.mass[j];
+            sorted_stars.speed_x[i] = stars.speed_x[j];
+            sorted_stars.speed_y[i] = stars.speed_y[j];
+            sorted_stars.accel_x[i] = stars.accel_x[j];
+            sorted_stars.accel_y[i] = stars.accel_y[j];
+            if (config.time_bins > 0) {
+                sorted_stars.step[i] = stars.step[j];
+                sorted_stars.level[i] = stars.level[j];
+            }
+            sorted_stars.id[i] = stars.id[j];
+        }
+    }
+}
+
+// First index in [begin, end) whose quadrant digit at [shift] exceeds [digit]
+static inline int quadrant_end(int begin, int end, int shift, uint64_t digit)
+{
+    while (begin < end) {
+        int middle = begin + (end - begin) / 2;
+        if (((keys[middle] >> shift) & 0x3) <= digit)
+            begin = middle + 1;
+        else
+            end = middle;
+    }
+    return begin;
+}
+
+// The side length of a quad is only kept in its walk node
+static inline void set_quad_size(int quad, double size)
+{
+    if (quads.walk)
+        quads.walk[quad].size = size;
+    else
+        quads.walk_float[quad].size = size;
+}
+
+// Find the quadrants of the current tree level: a quad spans the common key prefix of its stars
+static void split_job(int thread)
+{
+    int row_size = row_end - row_begin;
+    int new_quads = 0;
+    for (int i = row_begin + part_begin(thread, row_size); i < row_begin + part_begin(thread + 1, row_size); i++) {
+        int levels = common_levels(keys[quads.begin[i]], keys[quads.end[i] - 1]);
+        double size = ldexp(root_size, -levels);
+        set_quad_size(i, size);
+        if (quads.cell)
+            quads.cell[i] = size;
+        quads.first_child[i] = 0;
+        quads.child_count[i] = 0;
+        if (levels == 32 || quads.end[i] - quads.begin[i] <= config.leaf_size)
+            continue;  // a leaf, or several stars in the same point
+        int shift = 62 - 2*levels;
+        int begin = quads.begin[i];
+        int* ends = &child_ends[4 * (i - row_begin)];
+        for (uint64_t digit = (keys[begin] >> shift) & 0x3; begin < quads.end[i]; digit++) {
+            int end = quadrant_end(begin, quads.end[i], shift, digit);
+            if (end == begin)
+                continue;
+            ends[quads.child_count[i]++] = end;
+            begin = end;
+        }
+        new_quads += quads.child_count[i];
+    }
+    thread_sums[thread] = new_quads;
+}
+
+// Append the children of the current level; thread_sums already hold the first index for each thread
+static void link_job(int thread)
+{
+    int row_size = row_end - row_begin;
+    int next = thread_sums[thread];
+    for (int i = row_begin + part_begin(thread, row_size); i < row_begin + part_begin(thread + 1, row_size); i++) {
+        if (!quads.child_count[i])
+            continue;
+        quads.first_child[i] = next;
+        int begin = quads.begin[i];
+        for (int j = 0; j < quads.child_count[i]; j++) {
+            quads.begin[next] = begin;
+            quads.end[next] = child_ends[4 * (i - row_begin) + j];
+            begin = quads.end[next];
+            next++;
+        }
+    }
+}
+
+// Second and third moments about the center of mass, shifted from the children's by the parallel axis theorem,
+// or summed over the stars of a leaf
+static inline void moments(int quad)
+{
+    double qxx = 0, qxy = 0, qyy = 0;
+    double oxxx = 0, oxxy = 0, oxyy = 0, oyyy = 0;
+    bool octupole = config.multipole >= 3;
+    if (!quads.child_count[quad]) {
+        for (int star = quads.begin[quad]; star < quads.end[quad]; star++) {
+            double m = stars.mass[star];
+            double dx = stars.x[star] - quads.x[quad];
+            double dy = stars.y[star] - quads.y[quad];
+            qxx += m*dx*dx;
+            qxy += m*dx*dy;
+            qyy += m*dy*dy;
+            oxxx += m*dx*dx*dx;
+            oxxy += m*dx*dx*dy;
+            oxyy += m*dx*dy*dy;
+            oyyy += m*dy*dy*dy;
+        }
+    }
+    for (int child = quads.first_child[quad]; child < quads.first_child[quad] + quads.child_count[quad]; child++) {
+        double m = quads.mass[child];
+        double dx = quads.x[child] - quads.x[quad];
+        double dy = quads.y[child] - quads.y[quad];
+        double cxx = quads.qxx[child], cxy = quads.qxy[child], cyy = quads.qyy[child];
+        qxx += cxx + m*dx*dx;
+        qxy += cxy + m*dx*dy;
+        qyy += cyy + m*dy*dy;
+        if (!octupole)
+            continue;
+        oxxx += quads.oxxx[child] + 3*cxx*dx + m*dx*dx*dx;
+        oxxy += quads.oxxy[child] + 2*cxy*dx + cxx*dy + m*dx*dx*dy;
+        oxyy += quads.oxyy[child] + 2*cxy*dy + cyy*dx + m*dx*dy*dy;
+        oyyy += quads.oyyy[child] + 3*cyy*dy + m*dy*dy*dy;
+    }
+    quads.qxx[quad] = qxx;
+    quads.qxy[quad] = qxy;
+    quads.qyy[quad] = qyy;
+    if (octupole) {
+        quads.oxxx[quad] = oxxx;
+        quads.oxxy[quad] = oxxy;
+        quads.oxyy[quad] = oxyy;
+        quads.oyyy[quad] = oyyy;
+    }
+}
+
+// Grow the quad over the bounding box of its stars, which may have left its cell since the last build
+static inline void refit(int quad)
+{
+    double xmin = INFINITY, ymin = INFINITY, xmax = -INFINITY, ymax = -INFINITY;
+    if (quads.child_count[quad]) {
+        for (int child = quads.first_child[quad]; child < quads.first_child[quad] + quads.child_count[quad]; child++) {
+            xmin = std::min(xmin, quads.xmin[child]);
+            ymin = std::min(ymin, quads.ymin[child]);
+            xmax = std::max(xmax, quads.xmax[child]);
+            ymax = std::max(ymax, quads.ymax[child]);
+        }
+    } else {
+        for (int star = quads.begin[quad]; star < quads.end[quad]; star++) {
+            xmin = std::min(xmin, stars.x[star]);
+            ymin = std::min(ymin, stars.y[star]);
+            xmax = std::max(xmax, stars.x[star]);
+            ymax = std::max(ymax, stars.y[star]);
+        }
+    }
+    quads.xmin[quad] = xmin;
+    quads.ymin[quad] = ymin;
+    quads.xmax[quad] = xmax;
+    quads.ymax[quad] = ymax;
+    set_quad_size(quad, std::max(quads.cell[quad], std::max(xmax - xmin, ymax - ymin)));
+}
+
+// Drift velocities of the centers of mass of the current level, whose children are already done
+static void speed_job(int thread)
+{
+    int begin, end;
+    while (work.next(thread, &begin, &end))
+    for (int i = row_begin + begin; i < row_begin + end; i++) {
+        double speed_x = 0, speed_y = 0;
+        if (quads.child_count[i]) {
+            for (int child = quads.first_child[i]; child < quads.first_child[i] + quads.child_count[i]; child++) {
+                speed_x += quads.speed_x[child] * quads.mass[child];
+                speed_y += quads.speed_y[child] * quads.mass[child];
+            }
+        } else {
+            for (int star = quads.begin[i]; star < quads.end[i]; star++) {
+                speed_x += (stars.speed_x[star] + stars.accel_x[star]) * stars.mass[star];
+                speed_y += (stars.speed_y[star] + stars.accel_y[star]) * stars.mass[star];
+            }
+        }
+        quads.speed_x[i] = speed_x / quads.mass[i];
+        quads.speed_y[i] = speed_y / quads.mass[i];
+    }
+}
+
+// Copy the rest of what the tree walk needs into the quad's walk node
+static inline void pack_walk_node(int quad)
 {
-    int quadrant = 0;
-    if (star->x > quad->center.x)
-        quadrant++;
-    if (star->y > quad->center.y)
-        quadrant += 2;
-    return quadrant;
+    uint32_t link = quads.child_count[quad] ?
+            (uint32_t)quads.first_child[quad] << 3 | quads.child_count[quad] : (uint32_t)quads.begin[quad] << 3;
+    if (quads.walk) {
+        walk_node<double>& node = quads.walk[quad];
+        node.x = quads.x[quad];
+        node.y = quads.y[quad];
+        node.mass = quads.mass[quad];
+        node.link = link;
+    } else {
+        walk_node<float>& node = quads.walk_float[quad];
+        node.x = quads.x[quad];
+        node.y = quads.y[quad];
+        node.mass = quads.mass[quad];
+        node.link = link;
+    }
+}
+
+// Masses and centers of mass of the current level, whose children are already done
+static void mass_job(int thread)
+{
+    int begin, end;
+    while (work.next(thread, &begin, &end))
+    for (int i = row_begin + begin; i < row_begin + end; i++) {
+        double mass = 0, x = 0, y = 0;
+        if (quads.child_count[i]) {
+            for (int child = quads.first_child[i]; child < quads.first_child[i] + quads.child_count[i]; child++) {
+                mass += quads.mass[child];
+                x += quads.x[child] * quads.mass[child];
+                y += quads.y[child] * quads.mass[child];
+            }
+        } else {
+            for (int star = quads.begin[i]; star < quads.end[i]; star++) {
+                mass += stars.mass[star];
+                x += stars.x[star] * stars.mass[star];
+                y += stars.y[star] * stars.mass[star];
+            }
+        }
+        quads.mass[i] = mass;
+        quads.x[i] = x / mass;
+        quads.y[i] = y / mass;
+        if (config.multipole >= 2)
+            moments(i);
+        if (refitting)
+            refit(i);
+        pack_walk_node(i);
+    }
+}
+
+// The largest quads of at most config.group_size stars, or leaves, in Morton order
+static void find_groups()
+{
+    int stack[128];
+    int stack_size = 0;
+    stack[stack_size++] = 0;
+    group_count = 0;
+    while (stack_size) {
+        int quad = stack[--stack_size];
+        if (quads.end[quad] - quads.begin[quad] <= config.group_size || !quads.child_count[quad]) {
+            groups[group_count++] = quad;
+            continue;
+        }
+        for (int i = quads.first_child[quad] + quads.child_count[quad] - 1; i >= quads.first_child[quad]; i--)
+            stack[stack_size++] = i;
+    }
+}
+
+static const int min_parallel_row = 1024;  // smaller tree levels are not worth waking up the pool
+
+// Run the job bottom-up over the tree levels
+static void run_bottom_up(void (*job)(int thread))
+{
+    const int quad_chunk = 256;
+    for (int row = rows.size() - 2; row >= 0; row--) {
+        row_begin = rows[row];
+        row_end = rows[row + 1];
+        work.reset(row_end - row_begin, quad_chunk);
+        run_job(job, row_end - row_begin >= min_parallel_row);
+    }
+}
+
+// Sort the stars by their Morton keys and build a compressed quad-tree over them,
+// level by level, so that the result does not depend on the number of threads.
+// Returns the number of quads.
+static int build_tree(double xmin, double ymin, double size)
+{
+    const int star_chunk = 4096;
+    root_xmin = xmin;
+    root_ymin = ymin;
+    root_size = size;
+    key_scale = size > 0 ? 4294967296.0 / size : 0;
+    work.reset(config.stars, star_chunk);
+    run_job(key_job);
+    radix_sort();
+    work.reset(config.stars, star_chunk);
+    run_job(gather_job);
+    struct star_array stars_swap = stars;
+    stars = sorted_stars;
+    sorted_stars = stars_swap;
+
+    // Top-down topology, breadth first
+    rows.clear();
+    quads.begin[0] = 0;
+    quads.end[0] = config.stars;
+    int quad_count = 1;
+    for (row_begin = 0, row_end = 1; row_begin < row_end; row_begin = row_end, row_end = quad_count) {
+        rows.push_back(row_begin);
+        bool parallel = row_end - row_begin >= min_parallel_row;
+        run_job(split_job, parallel);
+        for (int thread = 0; thread < cores; thread++) {
+            int new_quads = thread_sums[thread];
+            thread_sums[thread] = quad_count;
+            quad_count += new_quads;
+        }
+        reserve_quads(quad_count);
+        run_job(link_job, parallel);
+    }
+    rows.push_back(quad_count);
+    tree_bytes = quad_count * quad_bytes;
+    if (peak_tree_bytes < tree_bytes)
+        peak_tree_bytes = tree_bytes.load();
+
+    refitting = false;
+    run_bottom_up(mass_job);
+    find_groups();
+    frames_since_build = 0;
+    tree_degraded = false;
+    return quad_count;
+}
+
+// Whether to refit the tree in this frame rather than to rebuild it
+static bool refit_due()
+{
+    if (config.refit_frames <= 0 || rows.empty())
+        return false;
+    if (!tree_degraded && frames_since_build < refit_limit)
+        return true;
+    if (tree_degraded) {
+        refit_limit = frames_since_build - 1;  // the last refit already cost too much
+    } else if (refit_limit > 0) {
+        refit_limit = std::min(2 * refit_limit, config.refit_frames);
+    } else if (++skipped_refits >= config.refit_frames) {  // try again, the stars may have calmed down
+        refit_limit = 1;
+        skipped_refits = 0;
+    }
+    return false;
+}
+
+// Keep the topology and the star order of the last build, and only update the masses and sizes.
+// Stars that left their cell stay in their quads, which grow over them.
+static void refit_tree()
+{
+    refitting = true;
+    run_bottom_up(mass_job);
+    frames_since_build++;
+}
+
+// Once the grown groups and quads cost config.refit_growth more interactions than right after
+// the last build, the next frame rebuilds the tree. The count does not depend on the number of threads.
+static void check_tree_quality()
+{
+    int64_t count = 0;
+    for (int thread = 0; thread < cores; thread++) {
+        count += thread_interactions[thread];
+        thread_interactions[thread] = 0;
+    }
+    if (frames_since_build == 0)
+        build_interactions = count;
+    else if (count > (1 + config.refit_growth) * build_interactions)
+        tree_degraded = true;
+}
+
+// Advance the frame in steps of the finest time step bin in use. Only the groups with stars at the end
+// of their steps walk the tree, whose centers of mass drift with the mean speed of their stars in between.
+static void block_steps()
+{
+    const int group_chunk = 16;
+    double tick_time = ldexp(frame_time, -config.time_bins);
+    for (tick = 0; tick < 1 << config.time_bins; ) {
+        tree_age = tick * tick_time;
+        active_count = 0;
+        for (int group = 0; group < group_count; group++)  // every star starts a step with the frame
+            if (tick == 0 || bin_active(group_levels[group]))
+                active_groups[active_count++] = group;
+        work.reset(active_count, group_chunk, config.schedule != "static");
+        job_start_time = get_time();
+        run_job(update_stars);
+        if (tick == 0) {
+            if (config.refit_frames > 0)
+                check_tree_quality();
+            run_bottom_up(speed_job);  // after the first kicks
+        }
+
+        int finest = 0;
+        for (int group = 0; group < group_count; group++)
+            finest = std::max(finest, group_levels[group]);
+        int ticks = 1 << (config.time_bins - finest);
+        tick += ticks;
+        drift(ticks * tick_time, tick == 1 << config.time_bins);
+    }
+    for (int thread = 0; thread < cores; thread++)
+        thread_interactions[thread] = 0;  // the tree quality is only measured at the full force pass
 }
 
 void world_frame(double time)
 {
+    if (replay.data) {  // constel-headless and constel-bench step the world directly
+        replay_world_frame(time);
+        return;
+    }
+    double perf_start = get_time();
     frame_time = time;
     if (frame_time > 1/config.min_fps)
         frame_time = 1/config.min_fps;
@@ -242,56 +1461,25 @@ void world_frame(double time)
     // Build Barnes-Hut qtree
     //************************
 
-    // Root node
-    double xmin_world = INFINITY;
-    double ymin_world = INFINITY;
-    double xmax_world = -INFINITY;
-    double ymax_world = -INFINITY;
-    for (int i = 0; i < config.stars; i++) {
-        if (xmin_world > stars[i].x)
-            xmin_world = stars[i].x;
-        if (xmax_world < stars[i].x)
-            xmax_world = stars[i].x;
-        if (ymin_world > stars[i].y)
-            ymin_world = stars[i].y;
-        if (ymax_world < stars[i].y)
-            ymax_world = stars[i].y;
-    }
-    quads[0].center.x = (xmin_world+xmax_world)/2;
-    quads[0].center.y = (ymin_world+ymax_world)/2;
-    double size_x = xmax_world - xmin_world;
-    double size_y = ymax_world - ymin_world;
-    quads[0].size = size_x > size_y ? size_x : size_y;  // keep nodes square
-    size_t quad_count = 1;  // number of quads
-
-    // Build the tree
-    for (struct star* star = stars; star < stars + config.stars; star++) {
-        struct quad* quad = &quads[0];
-        do {
-            // Add star to current quad
-            double mass_sum = quad->mass + star->mass;
-            quad->x = (quad->x * quad->mass + star->x * star->mass) / mass_sum;
-            quad->y = (quad->y * quad->mass + star->y * star->mass) / mass_sum;
-            quad->mass = mass_sum;
-            int quadrant = get_quadrant(quad, star);
-            if (quad->children[quadrant] == NULL) {
-                quad->children[quadrant] = (struct quad*)star;
-            } else if (quad->children[quadrant]->size == 0) {
-                struct star* old_star = (struct star*)(quad->children[quadrant]);
-                struct quad* new_quad = &quads[quad_count];
-                quad_count++;
-                new_quad->x = old_star->x;
-                new_quad->y = old_star->y;
-                new_quad->mass = old_star->mass;
-                new_quad->size = quad->size/2;
-                double shift = quad->size/4;
-                new_quad->center.x = quad->center.x + (quadrant&0x1 ? shift : -shift);
-                new_quad->center.y = quad->center.y + (quadrant&0x2 ? shift : -shift);
-                new_quad->children[get_quadrant(new_quad, old_star)] = (struct quad*)old_star;
-                quad->children[quadrant] = new_quad;
+    if (refit_due()) {
+        refit_tree();
+    } else {
+        // Root node, bounded by the last drift
+        if (!world_bounds_valid) {
+            world_bounds[0] = world_bounds[1] = INFINITY;
+            world_bounds[2] = world_bounds[3] = -INFINITY;
+            for (int i = 0; i < config.stars; i++) {
+                world_bounds[0] = std::min(world_bounds[0], stars.x[i]);
+                world_bounds[1] = std::min(world_bounds[1], stars.y[i]);
+                world_bounds[2] = std::max(world_bounds[2], stars.x[i]);
+                world_bounds[3] = std::max(world_bounds[3], stars.y[i]);
             }
-            quad = quad->children[quadrant];
-        } while (quad->size);
+            world_bounds_valid = true;
+        }
+        double size_x = world_bounds[2] - world_bounds[0];
+        double size_y = world_bounds[3] - world_bounds[1];
+        double size = size_x > size_y ? size_x : size_y;  // keep nodes square
+        build_tree(world_bounds[0], world_bounds[1], size);
     }
 
 
@@ -299,21 +1487,131 @@ void world_frame(double time)
     // Calculate acceleration and position
     //*************************************
 
-    // Wake up the threads in the pool
-    for (int i = 1; i < cores; i++)
-        sem_post(&job_start);
-    update_stars(0);  // job #0 is run synchronously
-    for (int i = 1; i < cores; i++)
-        sem_wait(&job_finish);
-    for (int i = 0; i < config.stars; i++) {
-        stars[i].x += frame_time * (stars[i].speed.x + stars[i].accel.x);  // velocity Verlet integration
-        stars[i].y += frame_time * (stars[i].speed.y + stars[i].accel.y);
+    double perf_build_end = get_time();
+    perf_build.add(perf_build_end - perf_start);
+    trace_event("build", perf_start, perf_build_end);
+
+    if (config.solver == "fmm") {
+        const int star_chunk = 4096;
+        struct fmm_tree tree = { quads.x, quads.y, quads.first_child, quads.child_count, quads.begin, quads.end,
+                stars.x, stars.y, stars.mass };
+        fmm_accel(&tree, new_accel_x, new_accel_y, thread_busy);
+        work.reset(config.stars, star_chunk);
+        run_job(kick_job);
+    } else if (config.time_bins > 0) {
+        block_steps();
+    } else {
+        const int group_chunk = 16;
+        work.reset(group_count, group_chunk, config.schedule != "static");
+        job_start_time = perf_build_end;
+        run_job(update_stars);
+        if (config.refit_frames > 0)
+            check_tree_quality();
     }
+    double perf_accel_end = get_time();
+    perf_accel.add(perf_accel_end - perf_build_end);
+    double busy_sum = 0, busy_max = 0;
+    for (int i = 0; i < cores; i++) {
+        busy_sum += thread_busy[i];
+        busy_max = std::max(busy_max, thread_busy[i]);
+    }
+    perf_imbalance.add(busy_sum > 0 ? busy_max * cores / busy_sum : 1);
+    trace_event("accel", perf_build_end, perf_accel_end);
+    if (config.solver == "fmm" || config.time_bins <= 0)  // block steps drift the stars themselves
+        drift(frame_time, true);
+    double perf_integrate_end = get_time();
+    perf_integrate.add(perf_integrate_end - perf_accel_end);
+    trace_event("integrate", perf_accel_end, perf_integrate_end);
 
-    // Display coordinates in GLfloat[]
-    for (int i = 0; i < config.stars; i++) {
-        disp_star_position[i][0] = stars[i].x;
-        disp_star_position[i][1] = stars[i].y;
+    frame_count++;
+    world_time += frame_time;
+    if (!config.snapshot.empty() && config.snapshot_every > 0 && frame_count % config.snapshot_every == 0)
+        save_snapshot();
+    if (recording && frame_count % config.traj_every == 0)
+        record_trajectory();
+}
+
+// Hand the complete disp_star_position over to the renderer and take the previous middle buffer for writing
+static void publish_star_positions()
+{
+    published_time.store(replay.data ? replay_time : world_time, std::memory_order_relaxed);
+    back_buffer = middle_buffer.exchange(back_buffer | fresh_positions, std::memory_order_acq_rel) & ~fresh_positions;
+    disp_star_position = position_buffers[back_buffer];
+}
+
+void use_star_position_buffers(vec2* const buffers[3])
+{
+    assert(!world_thread.joinable());
+    for (int i = 0; i < 3; i++) {
+        memcpy(buffers[i], position_buffers[i], config.stars * sizeof(vec2));
+        if (!external_positions)
+            free(position_buffers[i]);
+        position_buffers[i] = buffers[i];
+    }
+    external_positions = true;
+    disp_star_position = position_buffers[back_buffer];
+}
+
+double star_positions_time()
+{
+    return published_time.load(std::memory_order_relaxed);
+}
+
+void pause_replay()
+{
+    replay_paused = !replay_paused;
+}
+
+void seek_replay(int frames)
+{
+    replay_seek += frames;
+}
+
+void tree_memory(size_t* used, size_t* peak)
+{
+    *used = tree_bytes.load(std::memory_order_relaxed);
+    *peak = peak_tree_bytes.load(std::memory_order_relaxed);
+}
+
+bool fresh_star_positions()
+{
+    return middle_buffer.load(std::memory_order_relaxed) & fresh_positions;
+}
+
+const vec2* acquire_star_positions()
+{
+    if (middle_buffer.load(std::memory_order_relaxed) & fresh_positions)
+        front_buffer = middle_buffer.exchange(front_buffer, std::memory_order_acq_rel) & ~fresh_positions;
+    return position_buffers[front_buffer];
+}
+
+static void world_loop(std::stop_token stop)
+{
+    double last_time = get_time();
+    while (!stop.stop_requested()) {
+        double frame_start = get_time();
+        if (!replay.data) {
+            world_frame(frame_start - last_time);
+            publish_star_positions();
+        } else if (replay_world_frame(frame_start - last_time)) {
+            publish_star_positions();
+        }
+        last_time = frame_start;
+        double sleep_interval = last_time + 1/config.max_fps - get_time();
+        if (sleep_interval > 0)
+            std::this_thread::sleep_for(std::chrono::microseconds((int)(1e6 * sleep_interval)));
+    }
+}
+
+void start_world_thread()
+{
+    world_thread = std::jthread(world_loop);
+}
+
+void stop_world_thread()
+{
+    if (world_thread.joinable()) {
+        world_thread.request_stop();
+        world_thread.join();
     }
-    memset(quads, 0, quad_count * sizeof(struct quad));
 }
@@ -1,8 +1,32 @@
 #ifndef WORLD_H
 #define WORLD_H
 
+#include <stddef.h>
+#include "linmath.h"
+
 void init_world();
-void world_frame(double time);
+void world_frame(double time);  // or advance the replay of config.replay
 void finalize_world();
 
+// Run world_frame() on its own thread at up to config.max_fps, publishing the star positions after every frame
+void start_world_thread();
+void stop_world_thread();
+
+// The latest star positions published by the simulation thread; only for the render thread
+const vec2* acquire_star_positions();
+bool fresh_star_positions();  // acquire_star_positions() would return a new buffer
+double star_positions_time();  // simulated time of the latest published positions
+
+// With config.replay, the world thread plays the recorded positions back instead of simulating.
+// Safe from the render thread: toggle pausing, and move by whole recorded frames.
+void pause_replay();
+void seek_replay(int frames);
+
+// Bytes of the tree quads in the last build and the most since init_world(); safe from any thread
+void tree_memory(size_t* used, size_t* peak);
+
+// Write the positions into the renderer's buffers, e.g. mapped GL memory, instead of the world's own;
+// the buffers must outlive the world thread
+void use_star_position_buffers(vec2* const buffers[3]);
+
 #endif // WORLD_H